@@ -0,0 +1,62 @@
+#ifndef ANCHORS_H
+#define ANCHORS_H
+
+#include "kmeans.h"
+#include "matrix.h"
+
+#include <string>
+#include <vector>
+
+typedef enum {
+    BOX_FORMAT_YOLO, // one .txt per image, "class cx cy w h" per line in normalized coordinates (or a polygon)
+    BOX_FORMAT_COCO  // .json files with "bbox": [x, y, w, h] entries in pixels
+} box_format_t;
+
+box_format_t get_box_format(const char* s);
+
+// sizes of n boxes, box i is w[i] x h[i]. Two contiguous arrays so the IoU kernel reads 8 boxes at a time
+typedef struct {
+    int n;
+    std::vector<float> w, h;
+} box_set_t;
+
+// the annotation files of path in name order, path itself when it is a file
+std::vector<std::string> list_box_files(const std::string& path, box_format_t format);
+
+// parses all annotation files of path in parallel and appends their boxes in file order. Files are read in
+// small pieces and split into ranges of a few MB, so a single large COCO json is parsed by all threads.
+// Boxes without a positive width and height are skipped
+box_set_t load_boxes(const std::string& path, box_format_t format);
+
+// boxes of the annotation files as a (w, h) source for minibatch_kmeans. Every pass goes over the file ranges
+// in a new random order drawn from seed, so neither the seeding batch nor an early stop sees only the first
+// files. Only one range per thread is held in memory at a time
+kmeans_source_t make_box_source(const std::string& path, box_format_t format, unsigned int seed = 0);
+
+// IoU of boxes [start, end) with the anchor that overlaps them the most, both centered at the origin.
+// Eight boxes at a time on AVX2, ties go to the lowest anchor. best can be NULL
+void best_anchor_iou(const box_set_t& boxes, int start, int end, const matrix_t& anchors, int* best, float* iou);
+
+// mean over the boxes of the IoU with their best anchor
+float average_best_iou(const box_set_t& boxes, const matrix_t& anchors);
+
+typedef struct {
+    int max_iterations = 300;
+    unsigned int seed = 0;
+} anchor_options_t;
+
+typedef struct {
+    matrix_t anchors;   // k x 2 (w, h), sorted by area
+    float average_iou;  // mean IoU of the boxes with their best anchor
+    int iterations;
+} anchor_result_t;
+
+// k-means with 1 - IoU as the distance, seeded with k-means++. Anchors move to the mean size of their boxes
+anchor_result_t anchor_kmeans(const box_set_t& boxes, int k, const anchor_options_t& opt = anchor_options_t());
+
+// The same straight from the annotation files with memory that does not grow with the dataset: mini-batch
+// k-means over make_box_source seeded with opt.seed, then one more pass over the files for the average IoU
+anchor_result_t anchor_kmeans(const std::string& path, box_format_t format, int k,
+                              const minibatch_options_t& opt = minibatch_options_t());
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef BINARY_MASK_H
+#define BINARY_MASK_H
+
+#include "image.h"
+
+#include <cstdint>
+#include <vector>
+
+// bit packed binary image, 1 bit per pixel and 64 pixels per word.
+// Pixel x of row y is bit x%64 of bits[y*words_per_row + x/64]. Bits past w in the last word of a row are always 0
+typedef struct {
+    int w, h;
+    int words_per_row;
+    std::vector<uint64_t> bits;
+} binary_mask_t;
+
+binary_mask_t make_binary_mask(int w, int h);
+// pixels of channel c that are > thresh become foreground
+binary_mask_t pack_binary_mask(const image_t& m, float thresh = 0.f, int c = 0);
+// single channel image with 1 for foreground and 0 for background
+image_t unpack_binary_mask(const binary_mask_t& mask);
+
+// clears the bits past w in the last word of every row
+void clear_mask_padding(binary_mask_t* mask);
+int count_mask_pixels(const binary_mask_t& mask);
+
+// half-open horizontal run [x0, x1) of foreground pixels
+typedef struct {
+    int x0, x1;
+} run_t;
+
+// run-length encoded binary image. The runs of row y are runs[row_start[y]] .. runs[row_start[y+1]-1],
+// sorted by x and never touching each other, so memory grows with the number of runs and not with w*h
+typedef struct {
+    int w, h;
+    std::vector<int> row_start;
+    std::vector<run_t> runs;
+} run_mask_t;
+
+// finds the runs a word at a time with count trailing zeros, empty words cost a single compare
+run_mask_t make_run_mask(const binary_mask_t& mask);
+binary_mask_t unpack_run_mask(const run_mask_t& runs);
+
+static inline bool get_mask_bit(const binary_mask_t& mask, int x, int y)
+{
+    return (mask.bits[y*mask.words_per_row + (x >> 6)] >> (x & 63)) & 1;
+}
+
+static inline void set_mask_bit(binary_mask_t* mask, int x, int y, bool val)
+{
+    uint64_t& word = mask->bits[y*mask->words_per_row + (x >> 6)];
+    if(val) word |= (uint64_t)1 << (x & 63);
+    else word &= ~((uint64_t)1 << (x & 63));
+}
+
+#endif
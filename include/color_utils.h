@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "rng.h"
+#include "image.h"
 
 typedef struct {
     union {
@@ -14,6 +15,28 @@ typedef struct {
 
 color_t hsv_to_rgb(float h, float s, float v);
 
+// Whole-image color space conversions on the three CHW planes, run over pixel blocks on the thread pool.
+// The HSV and YCbCr loops are branch-free so the compiler vectorizes them, Lab has an AVX2 path.
+// HSV: h, s and v in [0, 1] (same convention as hsv_to_rgb).
+// Lab: CIE L*a*b* with a D65 white point from sRGB, L in [0, 100], a and b roughly in [-128, 127].
+// YCbCr: full range JPEG convention, all channels in [0, 1].
+typedef enum {
+    COLOR_SPACE_RGB,
+    COLOR_SPACE_HSV,
+    COLOR_SPACE_LAB,
+    COLOR_SPACE_YCBCR
+} color_space_t;
+
+color_space_t get_color_space(const char* s);
+void convert_color_space(const image_t& in, image_t* out, color_space_t from, color_space_t to);
+
+void rgb_to_hsv_image(const image_t& in, image_t* out);
+void hsv_to_rgb_image(const image_t& in, image_t* out);
+void rgb_to_lab_image(const image_t& in, image_t* out);
+void lab_to_rgb_image(const image_t& in, image_t* out);
+void rgb_to_ycbcr_image(const image_t& in, image_t* out);
+void ycbcr_to_rgb_image(const image_t& in, image_t* out);
+
 // https://martin.ankerl.com/2009/12/09/how-to-create-random-colors-programmatically/
 std::vector<color_t> get_colors(const int n);
 
@@ -2,16 +2,59 @@
 #define CONNECTED_COMPONENTS_H
 
 #include "image.h"
+#include "binary_mask.h"
+#include "morphology.h"
 
 #include <vector>
 
+typedef enum {
+    CC_CLASSIFY_RATIOS, // red/green/blue by their normalized ratios
+    CC_CLASSIFY_HUE     // by a hue range in HSV, more robust under lighting changes
+} cc_classify_mode_t;
+
 typedef struct {
     float r_g, r_b, r_n;
     float g_r, g_b, g_n;
     float b_r, b_g, b_n;
+    // optional morphological cleanup of the classified mask before labeling, 0 disables it
+    morph_op_t cleanup_op;
+    int cleanup_radius;
+    // hue range segmentation, h in [0, 1]. hue_min > hue_max selects a range that wraps around red
+    cc_classify_mode_t mode;
+    float hue_min, hue_max, min_saturation, min_value;
+    // components with fewer pixels are dropped, 0 keeps all of them
+    int min_area;
 } cc_options_t;
 
-void connected_components_bfs(const image_t& binary, const std::vector<std::pair<int,int> >& points, std::vector<int>* label);
-std::vector<int> connected_components(const image_t& m, cc_options_t opt, std::vector<std::pair<int,int> >* points);
+// per component statistics as a struct of arrays indexed by label
+typedef struct {
+    int count;
+    std::vector<int> area;
+    std::vector<int> x0, y0, x1, y1;  // inclusive bounding box
+    std::vector<float> cx, cy;        // centroid
+    std::vector<float> mxx, mxy, myy; // central second moments divided by the area
+    std::vector<float> r, g, b;       // mean color, 0 if no image was given
+} component_stats_t;
+
+// Two-pass scan labeling of the 8-connected foreground (> 0) of channel 0, with a decision tree over the
+// already scanned neighbours (Wu et al., SAUF) and a flat union-find. Components get consecutive labels
+// from 0 in scan order, background is -1. Returns the number of components
+int label_components(const image_t& binary, std::vector<int>* label);
+// Labels the 8-connected components of a run-length encoded mask with a union-find over the runs, so
+// time and memory scale with the number of runs. Strips of rows are labeled in parallel like
+// label_components. label gets one entry per run, consecutive from 0 in the same order as
+// label_components. Returns the number of components
+int label_runs(const run_mask_t& runs, std::vector<int>* label);
+
+// One pass over the labeled runs. Coordinate sums of a run have closed forms, so only the mean color
+// needs to touch the pixels, and then only the foreground ones. color may be NULL
+void compute_component_stats(const run_mask_t& runs, const std::vector<int>& label, int count, const image_t* color, component_stats_t* stats);
+// drops the components smaller than min_area from the table and relabels the rest consecutively,
+// runs of dropped components get label -1. Returns the new number of components
+int filter_components_by_area(std::vector<int>* label, component_stats_t* stats, int min_area);
+
+// classifies the colored pixels of m into a bit packed mask, optionally cleans it up and labels its runs.
+// Returns the label of every run in *runs, stats of every component go to *stats when it is not NULL
+std::vector<int> connected_components(const image_t& m, cc_options_t opt, run_mask_t* runs, component_stats_t* stats = NULL);
 
 #endif
@@ -0,0 +1,36 @@
+#ifndef CONTOURS_H
+#define CONTOURS_H
+
+#include "binary_mask.h"
+
+#include <vector>
+
+typedef struct {
+    int x, y;
+} contour_point_t;
+
+// closed polygon, the last point connects back to the first one
+typedef struct {
+    std::vector<contour_point_t> points;
+    bool is_hole;
+    int parent; // index of the border directly around this one, -1 if there is none
+} contour_t;
+
+// Suzuki-Abe border following. Finds every outer border and hole border of the 8-connected foreground
+// in a single raster scan, each traced once, together with the hierarchy of which border surrounds
+// which. Outer borders run counterclockwise on screen, holes clockwise.
+void find_contours(const binary_mask_t& mask, std::vector<contour_t>* contours);
+
+// scratch buffers for simplify_contour. Reusing one arena for many contours means no allocations once
+// it has grown to the largest contour
+typedef struct {
+    std::vector<std::pair<int,int> > stack;
+    std::vector<unsigned char> keep;
+} contour_arena_t;
+
+// Douglas-Peucker: keeps the points that are more than epsilon pixels away from the simplified polygon.
+// The closed contour is split at its first point and the point furthest from it, so both ends stay put
+void simplify_contour(const std::vector<contour_point_t>& in, float epsilon, contour_arena_t* arena, std::vector<contour_point_t>* out);
+void simplify_contours(std::vector<contour_t>* contours, float epsilon);
+
+#endif
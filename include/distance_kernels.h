@@ -0,0 +1,42 @@
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+#include "kmeans.h"
+
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// centers stored as structure of arrays: coordinate j of center c is vals[j*stride + c]. stride is k rounded
+// up to a multiple of 8 so every coordinate row can be read 8 centers at a time, the padding lanes are ignored
+typedef struct {
+    int k, d, stride;
+    std::vector<float> vals;
+} center_block_t;
+
+// centers in rows [from, to) of the matrix, to = -1 means all of them
+center_block_t make_center_block(const matrix_t& centers, int from = 0, int to = -1);
+
+// multiply-add that is fused exactly when the kernels are, so dist() and the kernels agree to the last bit
+static inline float madd(float a, float b, float c)
+{
+#ifdef __FMA__
+    return fmaf(a, b, c);
+#else
+    return a*b + c;
+#endif
+}
+
+// distance from x to every center of the block, written to out[0..k). L2 distances are left squared.
+// Runs on AVX2 eight centers at a time when the compiler targets it, otherwise as a plain loop
+void center_distances(const float* x, const center_block_t& centers, kmeans_metric_t metric, float* out);
+
+// index of the closest center of the block and the distance to it, ties go to the lowest index
+std::pair<int,float> get_closest_center(const float* x, const center_block_t& centers, kmeans_metric_t metric = L2);
+
+// closest center of each row of data in [start, end), written to index[i - start] and distance[i - start].
+// distance can be NULL
+void closest_centers(const matrix_t& data, int start, int end, const center_block_t& centers, kmeans_metric_t metric,
+                     int* index, float* distance);
+
+#endif
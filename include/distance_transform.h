@@ -0,0 +1,15 @@
+#ifndef DISTANCE_TRANSFORM_H
+#define DISTANCE_TRANSFORM_H
+
+#include "image.h"
+#include "binary_mask.h"
+
+// Exact Euclidean distance transform (Felzenszwalb & Huttenlocher). Every foreground pixel (> 0 in
+// channel 0) gets the distance to the nearest background pixel, background pixels get 0. Runs the 1-D
+// lower envelope of parabolas down the columns and then along the rows, both in parallel, O(w*h) total.
+// A mask without any background is DISTANCE_INF everywhere
+#define DISTANCE_INF 1e20f
+void distance_transform(const image_t& binary, image_t* out, bool squared = false);
+void distance_transform(const binary_mask_t& mask, image_t* out, bool squared = false);
+
+#endif
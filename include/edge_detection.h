@@ -0,0 +1,44 @@
+#ifndef EDGE_DETECTION_H
+#define EDGE_DETECTION_H
+
+#include "image.h"
+
+#include <vector>
+
+// gradient orientation quantized to the four neighbour axes used by non-maximum suppression
+typedef enum {
+    EDGE_DIR_0,   // gradient along x, compare left and right neighbours
+    EDGE_DIR_45,  // gradient along the x == y diagonal, compare (x-1,y-1) and (x+1,y+1)
+    EDGE_DIR_90,  // gradient along y, compare upper and lower neighbours
+    EDGE_DIR_135  // gradient along the x == -y diagonal, compare (x+1,y-1) and (x-1,y+1)
+} edge_direction_t;
+
+typedef struct {
+    float sigma = 1.4f; // gaussian smoothing before taking the gradient, 0 disables it
+    float low_threshold = 0.1f; // weak edges are kept only if they are connected to a strong edge
+    float high_threshold = 0.3f; // gradient magnitudes above this are always edges
+} canny_options_t;
+
+// wall-clock seconds spent in each stage of the canny pipeline
+typedef struct {
+    double blur, gradient, suppression, hysteresis;
+} canny_timings_t;
+
+// Fused sobel operator. A single pass over the image computes gx, gy, the gradient magnitude and the
+// quantized orientation(edge_direction_t) per pixel, instead of two full convolve_image passes with
+// make_gx_filter and make_gy_filter. Color images are converted to grayscale first, borders are clamped.
+// direction, gx and gy may be NULL when they are not needed.
+void sobel_image(const image_t& in, image_t* magnitude, std::vector<unsigned char>* direction,
+                 image_t* gx = NULL, image_t* gy = NULL);
+
+// keeps only pixels whose magnitude is a local maximum along their gradient direction
+void non_max_suppression(const image_t& magnitude, const std::vector<unsigned char>& direction, image_t* out);
+
+// marks every pixel >= high as an edge and grows edges into 8-connected pixels >= low.
+// Output is a binary single channel image.
+void hysteresis_threshold(const image_t& in, float low, float high, image_t* edges);
+
+// gaussian blur -> fused sobel -> non-maximum suppression -> hysteresis. timings may be NULL
+image_t canny_image(const image_t& in, const canny_options_t& opt, canny_timings_t* timings = NULL);
+
+#endif
@@ -18,11 +18,16 @@ typedef enum {
     SHARPEN,
     SMOOTHEN,
     GAUSSIAN,
+    MEDIAN,
+    BILATERAL,
 } filter_type_t;
 
 filter_type_t get_filter_type(const char* s);
+// nonlinear filters have no kernel, they are applied with median_filter_image/bilateral_filter_image
+bool is_nonlinear_filter(filter_type_t filter_type);
 image_t get_filter(filter_type_t filter_type);
 
+image_t make_identity_filter();
 image_t make_emboss_filter();
 image_t make_highpass_filter();
 image_t make_box_filter(int w = 3);
@@ -41,4 +46,19 @@ image_t make_sharpen_filter();
 image_t make_smoothing_filter();
 image_t make_gaussian_filter(float sigma = 0.5f);
 
+// separable gaussian blur with clamped borders, multi-threaded over rows.
+// Costs O(sigma) per pixel instead of the O(sigma^2) of convolve_image with make_gaussian_filter
+void gaussian_blur_image(const image_t& in, float sigma, image_t* out);
+
+// Constant time median filter(Perreault & Hebert, 2007) on the image quantized to 8 bits.
+// Keeps one 256-bin histogram per column, so the cost per pixel does not depend on the radius.
+// Borders are clamped, radius must be in [1, 127]. Multi-threaded over row bands
+void median_filter_image(const image_t& in, int radius, image_t* out);
+
+// Bilateral filter approximated with a bilateral grid(Paris & Durand, 2006). Pixels are splatted into a
+// grid downsampled by sigma_spatial in x,y and by sigma_range in intensity, the grid is blurred and then
+// sliced with trilinear interpolation. Color images use their luma as the edge-stopping guide.
+// sigma_range is in the [0, 1] intensity scale of image_t
+void bilateral_filter_image(const image_t& in, float sigma_spatial, float sigma_range, image_t* out);
+
 #endif
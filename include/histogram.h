@@ -0,0 +1,37 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "image.h"
+
+#include <vector>
+
+// per-channel histogram with bins of equal width covering [min, max]. Values outside the range
+// are counted in the first/last bin
+typedef struct {
+    int bins, c;
+    float min, max;
+    std::vector<long long> counts; // counts[k*bins + i] is bin i of channel k
+} histogram_t;
+
+// One pass over the image on the thread pool. Every thread fills a private histogram over its
+// own block of pixels and the private histograms are merged at the end, so there is no contention
+histogram_t compute_histogram(const image_t& m, int bins = 256, float min = 0.f, float max = 1.f);
+// 256 bins for 8 bit data with interleaved(HWC) channels, e.g. from stbi_load or get_hwc_bytes
+histogram_t compute_histogram(const unsigned char* hwc, int w, int h, int c);
+
+// sums all channels into a single channel histogram
+histogram_t merge_histogram_channels(const histogram_t& hist);
+
+// value at the upper edge of bin i, thresholding with > at this value splits bins [0, i] from the rest
+float histogram_bin_edge(const histogram_t& hist, int i);
+
+// Otsu's method, returns the threshold maximizing the between-class variance of the given channel
+float otsu_threshold(const histogram_t& hist, int channel = 0);
+// multi-level Otsu, returns num_classes-1 increasing thresholds. Solved with dynamic programming in
+// O(num_classes * bins^2) instead of trying every combination of thresholds
+std::vector<float> multi_otsu_thresholds(const histogram_t& hist, int num_classes, int channel = 0);
+
+// otsu threshold over all channels of the image followed by threshold_image, returns the threshold
+float threshold_image_otsu(const image_t& in, image_t* out);
+
+#endif
@@ -2,6 +2,7 @@
 #define IMAGE_H
 
 #include <vector>
+#include <string>
 
 // simple image struct that stores the pixel values in CHW-format
 typedef struct {
@@ -30,8 +31,13 @@ void fill_image(image_t* m, float s);
 void l1_normalize(image_t* im);
 void l2_normalize(image_t* im);
 
+// luma(0.299r + 0.587g + 0.114b) of an rgb image, single channel images are copied
+void rgb_to_grayscale(const image_t& in_rgb, image_t* out_gray);
+
 void threshold_image(const image_t& in_rgb, image_t* out_gray, float thresh);
 void threshold_image(const image_t& in_rgb, image_t* out_gray, float rt, float gt, float bt, float dt);
+// multi-level threshold with increasing thresholds, every pixel becomes (number of thresholds below it) / thresholds.size()
+void threshold_image(const image_t& in, image_t* out, const std::vector<float>& thresholds);
 
 void draw_box(image_t* m, int x1, int y1, int x2, int y2, float r, float g, float b);
 void draw_line(image_t* m, int x1, int y1, int x2, int y2, float r, float g, float b);
@@ -39,14 +45,21 @@ void draw_grid(image_t* m, int x_min, int x_max, int y_min, int y_max, int steps
 
 // Get HWC(channels interleaved) bytes from CHW(channels separate) float image
 std::vector<unsigned char> get_hwc_bytes(const image_t& m);
+// same as above, but reuses the storage of bytes instead of allocating a new buffer
+void get_hwc_bytes(const image_t& m, std::vector<unsigned char>* bytes);
 
 image_t load_image(const char* filename, int num_channels = 3);
 image_t load_image_rgb(const char* filename);
 image_t load_image_grayscale(const char* filename);
 
-void save_image_png(const image_t& m, const char* filename);
+// filename is given without extension. compression_level goes from 1(fast, large file) to 9(slow, small file)
+void save_image_png(const image_t& m, const char* filename, int compression_level = 8);
 void save_image_jpg(const image_t& m, const char* filename, int quality = 100);
 
+// encode already converted HWC bytes, returns false on failure
+bool write_png_bytes(const std::string& path, int w, int h, int c, const unsigned char* bytes, int compression_level = 8);
+bool write_jpg_bytes(const std::string& path, int w, int h, int c, const unsigned char* bytes, int quality = 100);
+
 void convolve_image(const image_t& in, const image_t& kernel, image_t* out, bool preserve);
 
 #endif
@@ -0,0 +1,30 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "image.h"
+
+#include <string>
+
+// Background image encoder. The calling thread only converts the image to HWC bytes,
+// the png/jpg encoding and the file io happen on a dedicated writer thread.
+// The bytes are stored in a fixed pool of reusable buffers, so if all buffers are
+// waiting to be written the caller blocks until the writer releases one.
+
+#define IMAGE_WRITER_NUM_BUFFERS 4
+
+typedef enum {
+    IMAGE_FORMAT_PNG,
+    IMAGE_FORMAT_JPG
+} image_format_t;
+
+// filename is given without extension, same as save_image_png/save_image_jpg
+void save_image_png_async(const image_t& m, const std::string& filename, int compression_level = 8);
+void save_image_jpg_async(const image_t& m, const std::string& filename, int quality = 100);
+
+// blocks until every queued image has been written to disk
+void wait_image_writes();
+
+// number of images that are queued or currently being encoded
+int num_pending_image_writes();
+
+#endif
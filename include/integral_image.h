@@ -0,0 +1,38 @@
+#ifndef INTEGRAL_IMAGE_H
+#define INTEGRAL_IMAGE_H
+
+#include "image.h"
+
+#include <vector>
+
+// Summed-area table. sum[c][(y+1)*(w+1) + (x+1)] holds the sum of all pixels in [0,x]x[0,y] of channel c,
+// with a zero first row and column so no lookup needs a bounds check. Accumulated in double to keep
+// precision on large images. sq_sum holds the same for squared pixels and is only filled on request.
+typedef struct {
+    int w, h, c;
+    std::vector<double> sum;
+    std::vector<double> sq_sum;
+} integral_image_t;
+
+// Built on the thread pool in two scans: prefix sums along every row, then running sums down the columns
+integral_image_t make_integral_image(const image_t& m, bool squared = false);
+
+// sums over the inclusive rectangle [x0,x1]x[y0,y1], which is clamped to the image. O(1) for any size
+double integral_sum(const integral_image_t& ii, int x0, int y0, int x1, int y1, int c = 0);
+double integral_sq_sum(const integral_image_t& ii, int x0, int y0, int x1, int y1, int c = 0);
+
+typedef enum {
+    ADAPTIVE_BRADLEY,
+    ADAPTIVE_SAUVOLA
+} adaptive_threshold_type_t;
+
+adaptive_threshold_type_t get_adaptive_threshold_type(const char* s);
+
+// Local thresholds over a (2*radius+1)^2 window, O(1) per pixel for any radius. Color images are
+// converted to grayscale, the output is a binary single channel image.
+// Bradley & Roth: a pixel is foreground if it is brighter than (1 - t) times its local mean.
+void adaptive_threshold_bradley(const image_t& in, image_t* out, int radius, float t = 0.15f);
+// Sauvola: a pixel is foreground if it is brighter than mean * (1 + k * (stddev / r - 1))
+void adaptive_threshold_sauvola(const image_t& in, image_t* out, int radius, float k = 0.34f, float r = 0.5f);
+
+#endif
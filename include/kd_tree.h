@@ -0,0 +1,33 @@
+#ifndef KD_TREE_H
+#define KD_TREE_H
+
+#include "matrix.h"
+
+#include <vector>
+
+// points [start, end) of the tree, children are -1 for leaves
+typedef struct {
+    int start, end;
+    int left, right;
+} kd_node_t;
+
+// KD-tree over the rows of a matrix. The points are copied into one contiguous array in tree order, so every
+// node covers a range of it and a leaf bucket is a dense block of at most leaf_size rows. Every node caches
+// its bounding box and the sum of its points, node i uses lo/hi/sum[i*d .. i*d + d)
+typedef struct {
+    int n, d, leaf_size;
+    std::vector<float> points; // n*d, row i of the tree is row index[i] of the matrix
+    std::vector<int> index;
+    std::vector<kd_node_t> nodes; // nodes[0] is the root, children always come after their parent
+    std::vector<float> lo, hi;
+    std::vector<double> sum;
+} kd_tree_t;
+
+// splits the widest side of the bounding box at the median until at most leaf_size points are left
+kd_tree_t make_kd_tree(const matrix_t& data, int leaf_size = 32);
+
+// the nodes at the given depth, and leaves above it, left to right. They split the tree into independent
+// subtrees that depend only on the data, not on the number of threads
+std::vector<int> kd_tree_frontier(const kd_tree_t& tree, int depth);
+
+#endif
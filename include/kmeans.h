@@ -3,6 +3,9 @@
 
 #include "matrix.h"
 
+#include <functional>
+#include <random>
+#include <string>
 #include <vector>
 
 typedef struct {
@@ -16,25 +19,141 @@ typedef enum {
     IOU
 } kmeans_metric_t;
 
-// initialization of centroids
-void random_centers(const matrix_t& data, matrix_t* centers);
-void smart_centers(const matrix_t& data, matrix_t* centers, kmeans_metric_t metric);
+// Elkan, Hamerly and Yinyang skip distances with the triangle inequality and assign the same points as lloyd
+// up to float rounding: they compare distances after the square root while lloyd compares squared L2
+// distances, so centers whose squared distances round to the same distance can be picked differently, and
+// the bounds carry rounding of their own. They need a metric, so IOU always runs lloyd. The filtering
+// algorithm assigns the same points but adds them up in tree order, so its centers can differ from lloyd's
+// in the last bits. It needs L2, other metrics run hamerly instead.
+typedef enum {
+    KMEANS_LLOYD,   // every point against every center on every iteration
+    KMEANS_ELKAN,   // k lower bounds per point, skips the most distances but needs n*k memory
+    KMEANS_HAMERLY, // one lower bound per point, best for low dimensional data
+    KMEANS_YINYANG, // one lower bound per group of about 10 centers, for large k
+    KMEANS_FILTER,  // KD-tree filtering (Kanungo et al. 2002), whole nodes at once, for 2 to 8 dimensions and L2
+    KMEANS_AUTO     // picks one of the above from n, k and the dimension
+} kmeans_algorithm_t;
+
+typedef struct {
+    int iterations;
+    long long distance_evaluations; // point to center, center to center and center drift distances, and for
+                                    // the filtering algorithm box to center distances
+    double inertia;                 // sum of the (squared for L2) distances to the assigned centers, 0 for mini-batch
+} kmeans_stats_t;
+
+kmeans_algorithm_t get_kmeans_algorithm(const char* s);
+// the algorithm KMEANS_AUTO runs for n points of dimension d and k centers
+kmeans_algorithm_t choose_kmeans_algorithm(int n, int k, int d);
+
+// initialization of centroids. They draw from gen when it is given, which makes them reproducible,
+// otherwise from a randomly seeded generator
+void random_centers(const matrix_t& data, matrix_t* centers, std::mt19937* gen = NULL);
+// k-means++: every next center is a point picked with probability proportional to its cost against the
+// centers so far, the squared distance to the closest one for L2 (D^2 sampling) and the distance otherwise,
+// times its weight when weights are given
+void smart_centers(const matrix_t& data, matrix_t* centers, kmeans_metric_t metric,
+                   const std::vector<float>* weights = NULL, std::mt19937* gen = NULL);
+// k-means|| (Bahmani et al. 2012): a few parallel passes each sample about oversampling points (2*k when 0)
+// proportionally to that same cost, then k-means++ picks the centers among those candidates, each weighted
+// by the number of points closest to it. Every pass only measures the points against the new candidates
+void scalable_centers(const matrix_t& data, matrix_t* centers, kmeans_metric_t metric,
+                      int rounds = 5, float oversampling = 0.f, std::mt19937* gen = NULL);
 
 // return distance to closest centroid measured in given metric
 // x is data point(box for IoU), y is the centroid(anchor for IoU)
-float dist(std::vector<float> x, std::vector<float> y, kmeans_metric_t metric = L2);
+float dist(const std::vector<float>& x, const std::vector<float>& y, kmeans_metric_t metric = L2);
 
-// Returns index of the closest center and the distance from given data to that center
+// Returns index of the closest center and the distance from given data to that center. Many points against
+// the same centers are faster with a center_block_t and closest_centers from distance_kernels.h
 std::pair<int,float> get_closest_center(const std::vector<float>& data, const matrix_t& centers, kmeans_metric_t metric = L2);
 
 // performs the "assignment" steps and assigns each cluster with its nearest centroid 
 // returns true if convergence has occurred
-bool kmeans_expectation(matrix_t data, model_t* model, kmeans_metric_t metric = L2);
+bool kmeans_expectation(const matrix_t& data, model_t* model, kmeans_metric_t metric = L2);
+
+// performs the "update" step of kmeans and assigns new centroids to each cluster, the weighted mean of
+// its points when weights are given
+void kmeans_maximization(const matrix_t& data, model_t* model, const std::vector<float>* weights = NULL);
+
+// actual kmeans. Fills stats when it is not NULL. With weights every row counts as that many points
+// (the filtering algorithm then runs hamerly)
+model_t kmeans(const matrix_t& data, int k, kmeans_metric_t metric, bool use_smart_centers,
+               kmeans_algorithm_t algorithm = KMEANS_LLOYD, kmeans_stats_t* stats = NULL,
+               const std::vector<float>* weights = NULL, std::mt19937* gen = NULL);
+
+typedef struct {
+    int n_init = 10;
+    bool use_smart_centers = true;
+    kmeans_algorithm_t algorithm = KMEANS_AUTO;
+    unsigned int seed = 0;
+} kmeans_restart_options_t;
+
+typedef struct {
+    unsigned int seed;
+    int run; // the generator of the run is seeded with (seed, run)
+    kmeans_stats_t stats;
+} kmeans_run_t;
 
-// performs the "update" step of kmeans and assigns new centroids to each cluster
-void kmeans_maximization(matrix_t data, model_t* model);
+// n_init independent runs of kmeans, all reading the same data and sharing one KD-tree when the filtering
+// algorithm runs. With at least as many runs as threads they run at the same time, one per thread and each
+// single threaded, otherwise one after the other with the whole pool. Each run has its own generator, so the
+// same seed gives the same models for any number of threads. Returns the model with the lowest inertia and,
+// when runs is not NULL, the statistics of every run
+model_t kmeans_restarts(const matrix_t& data, int k, kmeans_metric_t metric,
+                        const kmeans_restart_options_t& opt = kmeans_restart_options_t(),
+                        std::vector<kmeans_run_t>* runs = NULL, const std::vector<float>* weights = NULL);
+
+// sum of the (squared for L2) distances of the points to their closest center, weighted when weights are given
+double kmeans_cost(const matrix_t& data, const matrix_t& centers, kmeans_metric_t metric = L2,
+                   const std::vector<float>* weights = NULL);
+
+// weighted subset of the data whose k-means cost is close to the cost of the full data for any k centers
+typedef struct {
+    matrix_t points;
+    std::vector<float> weights;
+} coreset_t;
+
+// Sensitivity sampling: k-means++ on a small uniform sample gives a rough solution, one pass measures every
+// point against it and a second one samples size points with probability proportional to an upper bound on
+// how much each point can matter, weighted by the inverse of that probability. Smaller data is returned whole
+coreset_t make_coreset(const matrix_t& data, int k, int size, kmeans_metric_t metric = L2, unsigned int seed = 0);
+
+typedef struct {
+    int size = 2000;          // points in the coreset
+    bool assign_all = true;   // assign every row of the data to the centers at the end
+    kmeans_algorithm_t algorithm = KMEANS_AUTO;
+    unsigned int seed = 0;
+} coreset_options_t;
+
+// k-means++ and k-means on a coreset of the data, close to the centers of k-means on all of it at a
+// fraction of the cost. Without assign_all the returned model has no assignments
+model_t coreset_kmeans(const matrix_t& data, int k, kmeans_metric_t metric = L2,
+                       const coreset_options_t& opt = coreset_options_t(), kmeans_stats_t* stats = NULL);
+
+// A source of points for mini-batch k-means. Fills the rows of batch with up to batch_size points and
+// returns how many it wrote, 0 ends the run. batch is reused between calls so its rows keep their storage
+typedef std::function<int(int batch_size, matrix_t* batch)> kmeans_source_t;
+
+// random batches drawn with replacement from a matrix that has to outlive the source
+kmeans_source_t make_matrix_source(const matrix_t& data, unsigned int seed = 0);
+// consecutive chunks of rows of a csv file that is streamed from disk, starting over at the end of the file.
+// The rows should be in random order, sorted rows give batches that are not representative
+kmeans_source_t make_csv_source(const std::string& filename);
+
+typedef struct {
+    int batch_size = 1024;
+    int max_batches = 1000;
+    // stop once the smoothed batch inertia has not dropped by this fraction for max_no_improvement batches
+    float tolerance = 1e-3f;
+    int max_no_improvement = 10;
+    unsigned int seed = 0; // for the k-means++ seeding
+} minibatch_options_t;
 
-// actual kmeans
-model_t kmeans(matrix_t data, int k, kmeans_metric_t metric, bool use_smart_centers);
+// Mini-batch k-means (Sculley 2010): every batch is assigned to the current centers, then each point pulls
+// its center towards it with a per center learning rate of 1 / (points the center has seen so far).
+// Centers are seeded with k-means++ on a first batch of max(batch_size, 3*k) points. Memory depends on the
+// batch size only, the returned model has no assignments. stats counts batches as iterations
+model_t minibatch_kmeans(const kmeans_source_t& source, int k, kmeans_metric_t metric = L2,
+                         const minibatch_options_t& opt = minibatch_options_t(), kmeans_stats_t* stats = NULL);
 
 #endif
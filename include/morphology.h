@@ -0,0 +1,31 @@
+#ifndef MORPHOLOGY_H
+#define MORPHOLOGY_H
+
+#include "image.h"
+#include "binary_mask.h"
+
+// Morphology with a (2*rx+1) x (2*ry+1) rectangular structuring element.
+// Erosion and dilation use the van Herk/Gil-Werman algorithm, which takes 3 min/max operations per pixel
+// and axis no matter how large the structuring element is. Pixels outside the image are treated as
+// neutral, so erosion does not eat objects that touch the border and dilation does not grow from it.
+
+typedef enum {
+    MORPH_ERODE,
+    MORPH_DILATE,
+    MORPH_OPEN,  // erode then dilate, removes specks smaller than the structuring element
+    MORPH_CLOSE  // dilate then erode, fills holes smaller than the structuring element
+} morph_op_t;
+
+morph_op_t get_morph_op(const char* s);
+
+// grayscale morphology, every channel is processed independently
+void erode_image(const image_t& in, int rx, int ry, image_t* out);
+void dilate_image(const image_t& in, int rx, int ry, image_t* out);
+void morphology_image(const image_t& in, morph_op_t op, int rx, int ry, image_t* out);
+
+// binary fast path working on 64 pixels per operation
+void erode_mask(const binary_mask_t& in, int rx, int ry, binary_mask_t* out);
+void dilate_mask(const binary_mask_t& in, int rx, int ry, binary_mask_t* out);
+void morphology_mask(const binary_mask_t& in, morph_op_t op, int rx, int ry, binary_mask_t* out);
+
+#endif
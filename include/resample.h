@@ -0,0 +1,20 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "image.h"
+
+typedef enum {
+    RESAMPLE_BILINEAR,
+    RESAMPLE_BICUBIC, // Keys cubic with a = -0.5
+    RESAMPLE_LANCZOS3
+} resample_filter_t;
+
+resample_filter_t get_resample_filter(const char* s);
+
+// Separable resampling. The filter weights for every output column and row are computed once into
+// tables of fixed-length contiguous taps (border taps are folded into the edge pixels), then a
+// horizontal pass and a vertical pass run over row bands on the thread pool. When shrinking, the
+// filter is stretched by the scale factor so the result is properly low-pass filtered.
+void resize_image(const image_t& in, int w, int h, image_t* out, resample_filter_t filter = RESAMPLE_BICUBIC);
+
+#endif
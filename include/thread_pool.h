@@ -0,0 +1,17 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <functional>
+
+// number of threads used by parallel_for, including the calling thread.
+// Defaults to std::thread::hardware_concurrency()
+int get_num_threads();
+// must not be called while a parallel_for is running
+void set_num_threads(int num_threads);
+
+// splits [0, n) into contiguous chunks of at least min_chunk elements and calls fn(start, end)
+// for every chunk on the shared pool. The calling thread helps out and the call returns
+// when all chunks are done. Nested calls from inside fn run serially on the current thread.
+void parallel_for(int n, const std::function<void(int,int)>& fn, int min_chunk = 1);
+
+#endif
@@ -0,0 +1,554 @@
+#include "anchors.h"
+#include "distance_kernels.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <memory>
+#include <random>
+#include <sys/stat.h>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define ANCHORS_AVX2
+#endif
+
+box_format_t get_box_format(const char* s)
+{
+    if(strcmp(s, "yolo") == 0) return BOX_FORMAT_YOLO;
+    if(strcmp(s, "coco") == 0) return BOX_FORMAT_COCO;
+    return BOX_FORMAT_YOLO;
+}
+
+static bool has_extension(const std::string& name, const char* ext)
+{
+    const size_t len = strlen(ext);
+    return name.size() > len && name.compare(name.size() - len, len, ext) == 0;
+}
+
+std::vector<std::string> list_box_files(const std::string& path, box_format_t format)
+{
+    std::vector<std::string> files;
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+        fprintf(stderr, "Error: %s\n", path.c_str());
+        return files;
+    }
+    if(!S_ISDIR(st.st_mode)) {
+        files.push_back(path);
+        return files;
+    }
+
+    const char* ext = format == BOX_FORMAT_COCO ? ".json" : ".txt";
+    DIR* dir = opendir(path.c_str());
+    if(!dir) return files;
+    while(struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        // classes.txt sits next to the labels in many YOLO datasets but holds no boxes
+        if(!has_extension(name, ext) || name == "classes.txt") continue;
+        files.push_back(path + "/" + name);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+static void add_box(float w, float h, box_set_t* boxes)
+{
+    if(!(w > 0.f && h > 0.f)) return;
+    boxes->w.push_back(w);
+    boxes->h.push_back(h);
+    boxes->n++;
+}
+
+// files are read in pieces of this size, so memory does not grow with the size of a file
+static const int READ_CHUNK = 1 << 16;
+// and large files are split into ranges of this many bytes that are parsed in parallel
+static const long long FILE_RANGE = 1 << 23;
+
+// bytes [begin, end) of file. A box belongs to the range its line (YOLO) or "bbox" key (COCO) starts in
+typedef struct {
+    int file;
+    long long begin, end;
+} box_range_t;
+
+static std::vector<box_range_t> split_box_files(const std::vector<std::string>& files)
+{
+    std::vector<box_range_t> ranges;
+    for(int f = 0; f < (int)files.size(); ++f) {
+        struct stat st;
+        const long long size = stat(files[f].c_str(), &st) == 0 ? st.st_size : 0;
+        // an empty or unreadable file still gets a range, reading it reports the error
+        for(long long begin = 0; begin == 0 || begin < size; begin += FILE_RANGE) {
+            ranges.push_back({f, begin, std::min(size, begin + FILE_RANGE)});
+        }
+    }
+    return ranges;
+}
+
+// one line in [p, end) of "class cx cy w h" in normalized coordinates, or "class x1 y1 x2 y2 ..." for a
+// segmentation polygon whose extent is the box. The numbers are folded in as they are read
+template <typename Add>
+static void parse_yolo_line(const char* p, const char* end, Add add)
+{
+    int count = 0;
+    float fields[5];
+    float x0 = 0.f, x1 = 0.f, y0 = 0.f, y1 = 0.f;
+    while(p < end) {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        if(p == end) break;
+        char* next;
+        const float val = strtof(p, &next);
+        // not a number, the rest of the line is ignored
+        if(next == p || next > end) break;
+        p = next;
+        if(count < 5) fields[count] = val;
+        if(count == 1) x0 = x1 = val;
+        else if(count == 2) y0 = y1 = val;
+        else if(count % 2 == 1) { x0 = std::min(x0, val); x1 = std::max(x1, val); }
+        else if(count > 0) { y0 = std::min(y0, val); y1 = std::max(y1, val); }
+        count++;
+    }
+    if(count == 5) add(fields[3], fields[4]);
+    else if(count >= 7 && count % 2 == 1) add(x1 - x0, y1 - y0);
+}
+
+// The parsers take the text read so far, starting at file offset offset, and return how much of it they used.
+// The rest is an unfinished line or entry and is read again with the next piece. done is set once an entry
+// at or after end is reached. With bound_only add(1, 1) is called for every line or entry without parsing
+// the numbers, which bounds the number of boxes
+
+template <typename Add>
+static size_t parse_yolo(const std::string& text, long long offset, long long end, bool eof, bool bound_only,
+                         bool* done, Add add)
+{
+    size_t pos = 0;
+    while(pos < text.size()) {
+        if(offset + (long long)pos >= end) {
+            *done = true;
+            return pos;
+        }
+        size_t newline = text.find('\n', pos);
+        if(newline == std::string::npos) {
+            if(!eof) return pos;
+            newline = text.size();
+        }
+        if(bound_only) add(1.f, 1.f);
+        else parse_yolo_line(text.c_str() + pos, text.c_str() + newline, add);
+        pos = newline + 1;
+    }
+    return text.size();
+}
+
+template <typename Add>
+static size_t parse_coco(const std::string& text, long long offset, long long end, bool eof, bool bound_only,
+                         bool* done, Add add)
+{
+    static const char key[] = "\"bbox\"";
+    const size_t key_length = sizeof(key) - 1;
+    size_t pos = 0;
+    for(;;) {
+        const size_t found = text.find(key, pos);
+        if(found == std::string::npos) {
+            // the piece can end in the middle of a key, its start is kept for the next one
+            return eof ? text.size() : std::max(pos, text.size() - std::min(text.size(), key_length - 1));
+        }
+        if(offset + (long long)found >= end) {
+            *done = true;
+            return found;
+        }
+        const size_t close = text.find(']', found);
+        if(close == std::string::npos) return eof ? text.size() : found;
+        pos = close + 1;
+        if(bound_only) {
+            add(1.f, 1.f);
+            continue;
+        }
+
+        const char* p = text.c_str() + found + key_length;
+        const char* stop = text.c_str() + close;
+        while(p < stop && *p != '[') p++;
+        if(p == stop) continue;
+        p++;
+        float vals[4];
+        int count = 0;
+        for(; count < 4; ++count) {
+            while(*p == ' ' || *p == ',' || *p == '\n' || *p == '\r' || *p == '\t') p++;
+            char* next;
+            vals[count] = strtof(p, &next);
+            if(next == p || next > stop) break;
+            p = next;
+        }
+        if(count == 4) add(vals[2], vals[3]);
+    }
+}
+
+// reads the range piece by piece and calls add(w, h) for its boxes, without the check for a positive size
+template <typename Add>
+static void read_box_range(const std::string& filename, box_format_t format, const box_range_t& range,
+                           bool bound_only, Add add)
+{
+    FILE* file = fopen(filename.c_str(), "rb");
+    if(!file) {
+        fprintf(stderr, "Error: %s\n", filename.c_str());
+        return;
+    }
+    // a YOLO range starts at its first whole line, the byte before begin tells whether begin is one
+    bool skip_line = format == BOX_FORMAT_YOLO && range.begin > 0;
+    long long offset = skip_line ? range.begin - 1 : range.begin;
+    fseeko(file, offset, SEEK_SET);
+
+    std::string text;
+    char buffer[READ_CHUNK];
+    bool eof = false, done = false;
+    while(!eof && !done) {
+        const size_t read = fread(buffer, 1, sizeof(buffer), file);
+        eof = read < sizeof(buffer);
+        text.append(buffer, read);
+        if(skip_line) {
+            // the line begin falls into belongs to the range before
+            const size_t newline = text.find('\n');
+            const size_t skipped = newline == std::string::npos ? text.size() : newline + 1;
+            text.erase(0, skipped);
+            offset += skipped;
+            if(newline == std::string::npos) continue;
+            skip_line = false;
+        }
+        const size_t used = format == BOX_FORMAT_COCO ? parse_coco(text, offset, range.end, eof, bound_only, &done, add)
+                                                      : parse_yolo(text, offset, range.end, eof, bound_only, &done, add);
+        text.erase(0, used);
+        offset += used;
+    }
+    fclose(file);
+}
+
+static box_set_t parse_box_range(const std::vector<std::string>& files, box_format_t format, const box_range_t& range)
+{
+    box_set_t boxes = box_set_t();
+    read_box_range(files[range.file], format, range, false, [&](float w, float h) { add_box(w, h, &boxes); });
+    return boxes;
+}
+
+box_set_t load_boxes(const std::string& path, box_format_t format)
+{
+    const std::vector<std::string> files = list_box_files(path, format);
+    const std::vector<box_range_t> ranges = split_box_files(files);
+    const int num_ranges = ranges.size();
+
+    // Counting the lines or "bbox" keys of every range bounds its boxes without parsing a number. The boxes
+    // are then parsed straight into their slots of the result, so the boxes are only held once
+    std::vector<long long> count(num_ranges, 0), first(num_ranges + 1, 0);
+    parallel_for(num_ranges, [&](int start, int end) {
+        for(int r = start; r < end; ++r) {
+            read_box_range(files[ranges[r].file], format, ranges[r], true, [&](float, float) { count[r]++; });
+        }
+    }, 1);
+    for(int r = 0; r < num_ranges; ++r) first[r + 1] = first[r] + count[r];
+
+    box_set_t boxes = box_set_t();
+    boxes.w.resize(first[num_ranges]);
+    boxes.h.resize(first[num_ranges]);
+    parallel_for(num_ranges, [&](int start, int end) {
+        for(int r = start; r < end; ++r) {
+            // empty and unreadable files were already seen by the first pass
+            if(count[r] == 0) continue;
+            long long i = first[r];
+            read_box_range(files[ranges[r].file], format, ranges[r], false, [&](float w, float h) {
+                if(!(w > 0.f && h > 0.f)) return;
+                boxes.w[i] = w;
+                boxes.h[i] = h;
+                i++;
+            });
+            count[r] = i - first[r];
+        }
+    }, 1);
+
+    // lines without a box leave gaps, the ranges are moved together in order
+    long long n = 0;
+    for(int r = 0; r < num_ranges; ++r) {
+        std::copy(boxes.w.begin() + first[r], boxes.w.begin() + first[r] + count[r], boxes.w.begin() + n);
+        std::copy(boxes.h.begin() + first[r], boxes.h.begin() + first[r] + count[r], boxes.h.begin() + n);
+        n += count[r];
+    }
+    boxes.w.resize(n);
+    boxes.h.resize(n);
+    boxes.n = n;
+    return boxes;
+}
+
+typedef struct {
+    std::vector<std::string> files;
+    std::vector<box_range_t> ranges; // in the order of the current pass
+    box_format_t format;
+    std::mt19937 gen;
+    int next_range;
+    box_set_t buffer;
+    int pos;
+} box_stream_t;
+
+// parses the next group of ranges, one per thread, false once all ranges of the pass were read
+static bool refill_box_stream(box_stream_t* stream)
+{
+    const int remaining = stream->ranges.size() - stream->next_range;
+    if(remaining <= 0) return false;
+    const int count = std::min(remaining, std::max(1, get_num_threads()));
+    std::vector<box_set_t> parts(count);
+    parallel_for(count, [&](int start, int end) {
+        for(int i = start; i < end; ++i) {
+            parts[i] = parse_box_range(stream->files, stream->format, stream->ranges[stream->next_range + i]);
+        }
+    }, 1);
+
+    stream->buffer = box_set_t();
+    for(const box_set_t& part : parts) {
+        stream->buffer.w.insert(stream->buffer.w.end(), part.w.begin(), part.w.end());
+        stream->buffer.h.insert(stream->buffer.h.end(), part.h.begin(), part.h.end());
+        stream->buffer.n += part.n;
+    }
+    stream->pos = 0;
+    stream->next_range += count;
+    return true;
+}
+
+kmeans_source_t make_box_source(const std::string& path, box_format_t format, unsigned int seed)
+{
+    std::shared_ptr<box_stream_t> stream = std::make_shared<box_stream_t>();
+    stream->files = list_box_files(path, format);
+    stream->ranges = split_box_files(stream->files);
+    stream->format = format;
+    stream->gen.seed(seed);
+    std::shuffle(stream->ranges.begin(), stream->ranges.end(), stream->gen);
+    stream->next_range = 0;
+    stream->buffer = box_set_t();
+    stream->pos = 0;
+
+    return [stream](int batch_size, matrix_t* batch) {
+        batch->vals.resize(batch_size);
+        int n = 0;
+        bool restarted = false;
+        while(n < batch_size) {
+            if(stream->pos < stream->buffer.n) {
+                const int i = stream->pos++;
+                batch->vals[n].resize(2);
+                batch->vals[n][0] = stream->buffer.w[i];
+                batch->vals[n][1] = stream->buffer.h[i];
+                n++;
+                continue;
+            }
+            if(!refill_box_stream(stream.get())) {
+                // start the next pass over the files in a new order, files without boxes end the run
+                if(restarted) break;
+                restarted = true;
+                std::shuffle(stream->ranges.begin(), stream->ranges.end(), stream->gen);
+                stream->next_range = 0;
+            }
+        }
+        batch->vals.resize(n);
+        batch->rows = n;
+        batch->cols = 2;
+        return n;
+    };
+}
+
+// IoU written with the same multiply-adds as the IOU case of dist(), so both agree to the last bit
+static inline float box_iou(float bw, float bh, float aw, float ah)
+{
+    const float min_w = std::min(bw, aw), min_h = std::min(bh, ah);
+    return (min_w * min_h) / madd(-min_w, min_h, madd(aw, ah, bw * bh));
+}
+
+void best_anchor_iou(const box_set_t& boxes, int start, int end, const matrix_t& anchors, int* best, float* iou)
+{
+    const int k = anchors.rows;
+    std::vector<float> aw(k), ah(k);
+    for(int a = 0; a < k; ++a) {
+        aw[a] = anchors.vals[a][0];
+        ah[a] = anchors.vals[a][1];
+    }
+    const float* w = boxes.w.data();
+    const float* h = boxes.h.data();
+
+    int i = start;
+#ifdef ANCHORS_AVX2
+    // eight boxes against one anchor at a time, anchors are few so vectorizing over them wastes lanes
+    for(; i + 8 <= end; i += 8) {
+        const __m256 bw = _mm256_loadu_ps(w + i), bh = _mm256_loadu_ps(h + i);
+        const __m256 area = _mm256_mul_ps(bw, bh);
+        __m256 best_iou = _mm256_set1_ps(-1.f), best_index = _mm256_setzero_ps();
+        for(int a = 0; a < k; ++a) {
+            const __m256 anchor_w = _mm256_set1_ps(aw[a]), anchor_h = _mm256_set1_ps(ah[a]);
+            const __m256 min_w = _mm256_min_ps(bw, anchor_w), min_h = _mm256_min_ps(bh, anchor_h);
+            const __m256 uni = _mm256_fnmadd_ps(min_w, min_h, _mm256_fmadd_ps(anchor_w, anchor_h, area));
+            const __m256 cur = _mm256_div_ps(_mm256_mul_ps(min_w, min_h), uni);
+            const __m256 better = _mm256_cmp_ps(cur, best_iou, _CMP_GT_OQ);
+            best_iou = _mm256_blendv_ps(best_iou, cur, better);
+            best_index = _mm256_blendv_ps(best_index, _mm256_set1_ps((float)a), better);
+        }
+        _mm256_storeu_ps(iou + (i - start), best_iou);
+        if(best) _mm256_storeu_si256((__m256i*)(best + (i - start)), _mm256_cvtps_epi32(best_index));
+    }
+#endif
+    for(; i < end; ++i) {
+        float best_iou = -1.f;
+        int best_index = 0;
+        for(int a = 0; a < k; ++a) {
+            const float cur = box_iou(w[i], h[i], aw[a], ah[a]);
+            if(cur > best_iou) { best_iou = cur; best_index = a; }
+        }
+        iou[i - start] = best_iou;
+        if(best) best[i - start] = best_index;
+    }
+}
+
+// the parallel passes below work on fixed blocks of boxes and add up the blocks in order,
+// so the results do not depend on the number of threads
+static const int BOX_BLOCK = 16384;
+
+float average_best_iou(const box_set_t& boxes, const matrix_t& anchors)
+{
+    if(boxes.n == 0 || anchors.rows == 0) return 0.f;
+    const int num_blocks = (boxes.n + BOX_BLOCK - 1) / BOX_BLOCK;
+    std::vector<double> sums(num_blocks, 0.0);
+    parallel_for(num_blocks, [&](int start, int end) {
+        std::vector<float> iou(BOX_BLOCK);
+        for(int b = start; b < end; ++b) {
+            const int first = b*BOX_BLOCK, last = std::min(boxes.n, first + BOX_BLOCK);
+            best_anchor_iou(boxes, first, last, anchors, NULL, iou.data());
+            for(int i = 0; i < last - first; ++i) sums[b] += iou[i];
+        }
+    }, 1);
+    double sum = 0.0;
+    for(double s : sums) sum += s;
+    return sum / boxes.n;
+}
+
+static void sort_by_area(matrix_t* anchors)
+{
+    std::sort(anchors->vals.begin(), anchors->vals.end(), [](const std::vector<float>& a, const std::vector<float>& b) {
+        return a[0]*a[1] < b[0]*b[1];
+    });
+}
+
+anchor_result_t anchor_kmeans(const box_set_t& boxes, int k, const anchor_options_t& opt)
+{
+    anchor_result_t result;
+    k = std::min(k, boxes.n);
+    result.anchors = make_matrix(std::max(k, 0), 2);
+    result.average_iou = 0.f;
+    result.iterations = 0;
+    if(k <= 0) return result;
+
+    const int n = boxes.n;
+    const int num_blocks = (n + BOX_BLOCK - 1) / BOX_BLOCK;
+
+    // k-means++ with 1 - IoU, only the newest anchor is measured against every box
+    std::mt19937 gen(opt.seed);
+    std::uniform_int_distribution<int> pick(0, n - 1);
+    std::vector<float> closest(n, 1.f), iou(n);
+    matrix_t newest = make_matrix(1, 2);
+    for(int a = 0; a < k; ++a) {
+        int chosen = pick(gen);
+        if(a > 0) {
+            double total = 0.0;
+            for(int i = 0; i < n; ++i) total += closest[i];
+            double r = std::uniform_real_distribution<double>(0.0, total)(gen);
+            for(int i = 0; i < n; ++i) {
+                if(closest[i] <= 0.f) continue;
+                chosen = i;
+                r -= closest[i];
+                if(r <= 0) break;
+            }
+        }
+        result.anchors.vals[a] = newest.vals[0] = {boxes.w[chosen], boxes.h[chosen]};
+        parallel_for(num_blocks, [&](int start, int end) {
+            for(int b = start; b < end; ++b) {
+                const int first = b*BOX_BLOCK, last = std::min(n, first + BOX_BLOCK);
+                best_anchor_iou(boxes, first, last, newest, NULL, &iou[first]);
+                for(int i = first; i < last; ++i) closest[i] = std::min(closest[i], 1.f - iou[i]);
+            }
+        }, 1);
+    }
+
+    std::vector<int> assignment(n, -1);
+    std::vector<std::vector<double> > sums(num_blocks, std::vector<double>(3*k));
+    std::vector<double> iou_sums(num_blocks);
+    for(;;) {
+        std::vector<char> changed(num_blocks, 0);
+        parallel_for(num_blocks, [&](int start, int end) {
+            std::vector<int> best(BOX_BLOCK);
+            for(int b = start; b < end; ++b) {
+                const int first = b*BOX_BLOCK, last = std::min(n, first + BOX_BLOCK);
+                best_anchor_iou(boxes, first, last, result.anchors, best.data(), &iou[first]);
+                std::fill(sums[b].begin(), sums[b].end(), 0.0);
+                iou_sums[b] = 0.0;
+                for(int i = first; i < last; ++i) {
+                    const int a = best[i - first];
+                    if(assignment[i] != a) changed[b] = 1;
+                    assignment[i] = a;
+                    sums[b][3*a] += boxes.w[i];
+                    sums[b][3*a + 1] += boxes.h[i];
+                    sums[b][3*a + 2] += 1.0;
+                    iou_sums[b] += iou[i];
+                }
+            }
+        }, 1);
+        result.iterations++;
+
+        double iou_sum = 0.0;
+        for(int b = 0; b < num_blocks; ++b) iou_sum += iou_sums[b];
+        result.average_iou = iou_sum / n;
+        if(std::find(changed.begin(), changed.end(), 1) == changed.end() || result.iterations >= opt.max_iterations) break;
+
+        for(int a = 0; a < k; ++a) {
+            double w = 0.0, h = 0.0, count = 0.0;
+            for(int b = 0; b < num_blocks; ++b) {
+                w += sums[b][3*a];
+                h += sums[b][3*a + 1];
+                count += sums[b][3*a + 2];
+            }
+            // an anchor without boxes stays where it is
+            if(count > 0) result.anchors.vals[a] = {(float)(w / count), (float)(h / count)};
+        }
+    }
+
+    sort_by_area(&result.anchors);
+    return result;
+}
+
+anchor_result_t anchor_kmeans(const std::string& path, box_format_t format, int k, const minibatch_options_t& opt)
+{
+    anchor_result_t result;
+    kmeans_stats_t stats = {0, 0, 0.0};
+    model_t model = minibatch_kmeans(make_box_source(path, format, opt.seed), k, IOU, opt, &stats);
+    result.anchors = model.centers;
+    result.iterations = stats.iterations;
+    result.average_iou = 0.f;
+    sort_by_area(&result.anchors);
+    if(result.anchors.rows == 0) return result;
+
+    // one range per task, so only as many ranges as there are threads are in memory
+    const std::vector<std::string> files = list_box_files(path, format);
+    const std::vector<box_range_t> ranges = split_box_files(files);
+    std::vector<double> sums(ranges.size(), 0.0);
+    std::vector<int> counts(ranges.size(), 0);
+    parallel_for(ranges.size(), [&](int start, int end) {
+        for(int r = start; r < end; ++r) {
+            const box_set_t boxes = parse_box_range(files, format, ranges[r]);
+            std::vector<float> iou(boxes.n);
+            best_anchor_iou(boxes, 0, boxes.n, result.anchors, NULL, iou.data());
+            for(float v : iou) sums[r] += v;
+            counts[r] = boxes.n;
+        }
+    }, 1);
+    double sum = 0.0;
+    long long count = 0;
+    for(size_t r = 0; r < ranges.size(); ++r) {
+        sum += sums[r];
+        count += counts[r];
+    }
+    result.average_iou = count ? sum / count : 0.f;
+    return result;
+}
@@ -0,0 +1,97 @@
+#include "binary_mask.h"
+
+#include <cassert>
+
+binary_mask_t make_binary_mask(int w, int h)
+{
+    binary_mask_t mask;
+    mask.w = w;
+    mask.h = h;
+    mask.words_per_row = (w + 63) / 64;
+    mask.bits = std::vector<uint64_t>(mask.words_per_row*h, 0);
+    return mask;
+}
+
+binary_mask_t pack_binary_mask(const image_t& m, float thresh, int c)
+{
+    assert(c < m.c);
+    binary_mask_t mask = make_binary_mask(m.w, m.h);
+    for(int y = 0; y < m.h; ++y) {
+        const float* row = &m.data[c*m.w*m.h + y*m.w];
+        uint64_t* words = &mask.bits[y*mask.words_per_row];
+        for(int i = 0; i < mask.words_per_row; ++i) {
+            const int x0 = 64*i, n = m.w - x0 < 64 ? m.w - x0 : 64;
+            uint64_t word = 0;
+            for(int b = 0; b < n; ++b) word |= (uint64_t)(row[x0+b] > thresh) << b;
+            words[i] = word;
+        }
+    }
+    return mask;
+}
+
+image_t unpack_binary_mask(const binary_mask_t& mask)
+{
+    image_t m = make_image_grayscale(mask.w, mask.h);
+    for(int y = 0; y < mask.h; ++y) {
+        float* row = &m.data[y*mask.w];
+        for(int x = 0; x < mask.w; ++x) row[x] = get_mask_bit(mask, x, y) ? 1.f : 0.f;
+    }
+    return m;
+}
+
+void clear_mask_padding(binary_mask_t* mask)
+{
+    const int tail = mask->w & 63;
+    if(tail == 0) return;
+    const uint64_t keep = ((uint64_t)1 << tail) - 1;
+    for(int y = 0; y < mask->h; ++y) mask->bits[(y+1)*mask->words_per_row - 1] &= keep;
+}
+
+int count_mask_pixels(const binary_mask_t& mask)
+{
+    int count = 0;
+    for(uint64_t word : mask.bits) count += __builtin_popcountll(word);
+    return count;
+}
+
+run_mask_t make_run_mask(const binary_mask_t& mask)
+{
+    run_mask_t runs;
+    runs.w = mask.w;
+    runs.h = mask.h;
+    runs.row_start.resize(mask.h + 1);
+    for(int y = 0; y < mask.h; ++y) {
+        runs.row_start[y] = runs.runs.size();
+        const uint64_t* words = &mask.bits[y*mask.words_per_row];
+        bool in_run = false;
+        int start = 0;
+        for(int i = 0; i < mask.words_per_row; ++i) {
+            const uint64_t word = words[i];
+            if(word == (in_run ? ~(uint64_t)0 : 0)) continue;
+            // jump from one state change to the next, looking for a 1 outside a run and a 0 inside one
+            for(int pos = 0; pos < 64; ) {
+                const uint64_t rest = (in_run ? ~word : word) >> pos;
+                if(rest == 0) break;
+                pos += __builtin_ctzll(rest);
+                if(in_run) runs.runs.push_back({start, 64*i + pos});
+                else start = 64*i + pos;
+                in_run = !in_run;
+            }
+        }
+        // the padding bits are 0, so only a run reaching a multiple of 64 is still open here
+        if(in_run) runs.runs.push_back({start, mask.w});
+    }
+    runs.row_start[mask.h] = runs.runs.size();
+    return runs;
+}
+
+binary_mask_t unpack_run_mask(const run_mask_t& runs)
+{
+    binary_mask_t mask = make_binary_mask(runs.w, runs.h);
+    for(int y = 0; y < runs.h; ++y) {
+        for(int i = runs.row_start[y]; i < runs.row_start[y+1]; ++i) {
+            for(int x = runs.runs[i].x0; x < runs.runs[i].x1; ++x) set_mask_bit(&mask, x, y, true);
+        }
+    }
+    return mask;
+}
@@ -1,4 +1,16 @@
 #include "color_utils.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define COLOR_UTILS_AVX2
+#endif
 
 color_t hsv_to_rgb(float h, float s, float v)
 {
@@ -50,3 +62,311 @@ std::vector<color_t> get_colors(const int n)
     }
     return colors;
 }
+
+color_space_t get_color_space(const char* s)
+{
+    if(strcmp(s, "rgb") == 0) return COLOR_SPACE_RGB;
+    if(strcmp(s, "hsv") == 0) return COLOR_SPACE_HSV;
+    if(strcmp(s, "lab") == 0) return COLOR_SPACE_LAB;
+    if(strcmp(s, "ycbcr") == 0) return COLOR_SPACE_YCBCR;
+    return COLOR_SPACE_RGB;
+}
+
+// converts n pixels of the three input planes into the three output planes. The planes never overlap,
+// __restrict tells the compiler so and lets it vectorize the loop without runtime alias checks
+typedef void (*plane_kernel_t)(const float* __restrict c0, const float* __restrict c1, const float* __restrict c2,
+                               float* __restrict o0, float* __restrict o1, float* __restrict o2, int n);
+
+// runs kernel over blocks of the three planes, one call per block
+static void convert_planes(const image_t& in, image_t* out, plane_kernel_t kernel)
+{
+    assert(in.c == 3);
+    const int n = in.w*in.h;
+    *out = make_image(in.w, in.h, 3);
+    const float* src = in.data.data();
+    float* dst = out->data.data();
+    parallel_for(n, [&](int start, int end) {
+        kernel(src + start, src + n + start, src + 2*n + start,
+               dst + start, dst + n + start, dst + 2*n + start, end - start);
+    }, 1 << 14);
+}
+
+static void rgb_to_hsv_block(const float* __restrict r, const float* __restrict g, const float* __restrict b,
+                             float* __restrict h, float* __restrict s, float* __restrict v, int n)
+{
+    for(int i = 0; i < n; ++i) {
+        const float max = std::max(r[i], std::max(g[i], b[i]));
+        const float min = std::min(r[i], std::min(g[i], b[i]));
+        const float delta = max - min;
+        // delta and max are never negative, max(x, tiny) keeps the division safe without a branch
+        const float inv = 1.f / std::max(delta, 1e-30f);
+        // every case is computed and the right one selected, so there is no branch in the loop
+        const float hue_r = (g[i] - b[i]) * inv;
+        const float hue_g = (b[i] - r[i]) * inv + 2.f;
+        const float hue_b = (r[i] - g[i]) * inv + 4.f;
+        float hue = max == r[i] ? hue_r : (max == g[i] ? hue_g : hue_b);
+        hue = delta > 0.f ? hue * (1.f / 6.f) : 0.f;
+        h[i] = hue < 0.f ? hue + 1.f : hue;
+        s[i] = max > 0.f ? delta / std::max(max, 1e-30f) : 0.f;
+        v[i] = max;
+    }
+}
+
+static void hsv_to_rgb_block(const float* __restrict h, const float* __restrict s, const float* __restrict v,
+                             float* __restrict r, float* __restrict g, float* __restrict b, int n)
+{
+    // f(n) = v - v*s*clamp(min(k, 4-k), 0, 1) with k = (n + 6h) mod 6 gives r, g, b for n = 5, 3, 1
+    for(int i = 0; i < n; ++i) {
+        const float h6 = h[i] * 6.f, vs = v[i] * s[i];
+        float kr = 5.f + h6, kg = 3.f + h6, kb = 1.f + h6;
+        kr -= kr >= 6.f ? 6.f : 0.f; kr -= kr >= 6.f ? 6.f : 0.f;
+        kg -= kg >= 6.f ? 6.f : 0.f; kg -= kg >= 6.f ? 6.f : 0.f;
+        kb -= kb >= 6.f ? 6.f : 0.f; kb -= kb >= 6.f ? 6.f : 0.f;
+        r[i] = v[i] - vs * std::max(0.f, std::min(std::min(kr, 4.f - kr), 1.f));
+        g[i] = v[i] - vs * std::max(0.f, std::min(std::min(kg, 4.f - kg), 1.f));
+        b[i] = v[i] - vs * std::max(0.f, std::min(std::min(kb, 4.f - kb), 1.f));
+    }
+}
+
+void rgb_to_hsv_image(const image_t& in, image_t* out)
+{
+    convert_planes(in, out, rgb_to_hsv_block);
+}
+
+void hsv_to_rgb_image(const image_t& in, image_t* out)
+{
+    convert_planes(in, out, hsv_to_rgb_block);
+}
+
+#define GAMMA_TABLE_SIZE 4096
+
+// sRGB transfer curves sampled on [0, 1] and linearly interpolated, pow() does not vectorize
+typedef struct {
+    float to_linear[GAMMA_TABLE_SIZE+1];
+    float to_srgb[GAMMA_TABLE_SIZE+1];
+} gamma_tables_t;
+
+static const gamma_tables_t& get_gamma_tables()
+{
+    static gamma_tables_t tables;
+    static bool initialized = [](){
+        for(int i = 0; i <= GAMMA_TABLE_SIZE; ++i) {
+            double v = (double)i / GAMMA_TABLE_SIZE;
+            tables.to_linear[i] = v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+            tables.to_srgb[i] = v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+        }
+        return true;
+    }();
+    (void)initialized;
+    return tables;
+}
+
+static inline float gamma_lookup(const float* table, float v)
+{
+    float f = std::min(std::max(v, 0.f), 1.f) * GAMMA_TABLE_SIZE;
+    int i = std::min((int)f, GAMMA_TABLE_SIZE-1);
+    return table[i] + (f - i) * (table[i+1] - table[i]);
+}
+
+// bit-level initial guess refined with two newton steps, accurate to ~1e-6 for x > 0
+static inline float fast_cbrt(float x)
+{
+    int32_t i;
+    memcpy(&i, &x, sizeof(i));
+    i = i / 3 + 709921077;
+    float y;
+    memcpy(&y, &i, sizeof(y));
+    y = (2.f*y + x / (y*y)) * (1.f / 3.f);
+    y = (2.f*y + x / (y*y)) * (1.f / 3.f);
+    return y;
+}
+
+static inline float lab_f(float t)
+{
+    return t > 216.f / 24389.f ? fast_cbrt(t) : (24389.f / 27.f * t + 16.f) / 116.f;
+}
+
+static inline float lab_f_inv(float f)
+{
+    float f3 = f*f*f;
+    return f3 > 216.f / 24389.f ? f3 : (116.f * f - 16.f) / (24389.f / 27.f);
+}
+
+// D65 reference white
+static const float WHITE_X = 0.95047f, WHITE_Y = 1.f, WHITE_Z = 1.08883f;
+
+#ifdef COLOR_UTILS_AVX2
+// The Lab loops need table gathers, which gcc does not if-convert reliably, so they have 8 pixel versions
+// of the helpers above with the same arithmetic
+
+static inline __m256 gamma_lookup8(const float* table, __m256 v)
+{
+    const __m256 f = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.f)),
+                                   _mm256_set1_ps(GAMMA_TABLE_SIZE));
+    const __m256i i = _mm256_min_epi32(_mm256_cvttps_epi32(f), _mm256_set1_epi32(GAMMA_TABLE_SIZE-1));
+    const __m256 lo = _mm256_i32gather_ps(table, i, 4), hi = _mm256_i32gather_ps(table + 1, i, 4);
+    return _mm256_fmadd_ps(_mm256_sub_ps(f, _mm256_cvtepi32_ps(i)), _mm256_sub_ps(hi, lo), lo);
+}
+
+static inline __m256 fast_cbrt8(__m256 x)
+{
+    // i / 3 for non-negative i as (i * 0xAAAAAAAB) >> 33, the even and odd lanes are multiplied separately
+    const __m256i i = _mm256_castps_si256(x), magic = _mm256_set1_epi32(0xAAAAAAAB);
+    const __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(i, magic), 33);
+    const __m256i odd = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(i, 32), magic), 1);
+    const __m256i third = _mm256_blend_epi32(even, odd, 0xAA);
+    __m256 y = _mm256_castsi256_ps(_mm256_add_epi32(third, _mm256_set1_epi32(709921077)));
+    const __m256 two = _mm256_set1_ps(2.f), one_third = _mm256_set1_ps(1.f / 3.f);
+    y = _mm256_mul_ps(_mm256_fmadd_ps(two, y, _mm256_div_ps(x, _mm256_mul_ps(y, y))), one_third);
+    y = _mm256_mul_ps(_mm256_fmadd_ps(two, y, _mm256_div_ps(x, _mm256_mul_ps(y, y))), one_third);
+    return y;
+}
+
+static inline __m256 lab_f8(__m256 t)
+{
+    const __m256 epsilon = _mm256_set1_ps(216.f / 24389.f);
+    const __m256 root = fast_cbrt8(_mm256_max_ps(t, epsilon));
+    const __m256 linear = _mm256_div_ps(_mm256_fmadd_ps(_mm256_set1_ps(24389.f / 27.f), t, _mm256_set1_ps(16.f)),
+                                        _mm256_set1_ps(116.f));
+    return _mm256_blendv_ps(linear, root, _mm256_cmp_ps(t, epsilon, _CMP_GT_OQ));
+}
+
+static inline __m256 lab_f_inv8(__m256 f)
+{
+    const __m256 f3 = _mm256_mul_ps(_mm256_mul_ps(f, f), f);
+    const __m256 linear = _mm256_div_ps(_mm256_fmsub_ps(_mm256_set1_ps(116.f), f, _mm256_set1_ps(16.f)),
+                                        _mm256_set1_ps(24389.f / 27.f));
+    return _mm256_blendv_ps(linear, f3, _mm256_cmp_ps(f3, _mm256_set1_ps(216.f / 24389.f), _CMP_GT_OQ));
+}
+
+// a*x + b*y + c*z
+static inline __m256 dot3(float a, __m256 x, float b, __m256 y, float c, __m256 z)
+{
+    return _mm256_fmadd_ps(_mm256_set1_ps(c), z, _mm256_fmadd_ps(_mm256_set1_ps(b), y, _mm256_mul_ps(_mm256_set1_ps(a), x)));
+}
+#endif
+
+static void rgb_to_lab_block(const float* __restrict r, const float* __restrict g, const float* __restrict b,
+                             float* __restrict L, float* __restrict A, float* __restrict B, int n)
+{
+    const float* __restrict to_linear = get_gamma_tables().to_linear;
+    int i = 0;
+#ifdef COLOR_UTILS_AVX2
+    for(; i + 8 <= n; i += 8) {
+        const __m256 lr = gamma_lookup8(to_linear, _mm256_loadu_ps(r + i));
+        const __m256 lg = gamma_lookup8(to_linear, _mm256_loadu_ps(g + i));
+        const __m256 lb = gamma_lookup8(to_linear, _mm256_loadu_ps(b + i));
+        const __m256 x = _mm256_div_ps(dot3(0.4124564f, lr, 0.3575761f, lg, 0.1804375f, lb), _mm256_set1_ps(WHITE_X));
+        const __m256 y = _mm256_div_ps(dot3(0.2126729f, lr, 0.7151522f, lg, 0.0721750f, lb), _mm256_set1_ps(WHITE_Y));
+        const __m256 z = _mm256_div_ps(dot3(0.0193339f, lr, 0.1191920f, lg, 0.9503041f, lb), _mm256_set1_ps(WHITE_Z));
+        const __m256 fx = lab_f8(x), fy = lab_f8(y), fz = lab_f8(z);
+        _mm256_storeu_ps(L + i, _mm256_fmsub_ps(_mm256_set1_ps(116.f), fy, _mm256_set1_ps(16.f)));
+        _mm256_storeu_ps(A + i, _mm256_mul_ps(_mm256_set1_ps(500.f), _mm256_sub_ps(fx, fy)));
+        _mm256_storeu_ps(B + i, _mm256_mul_ps(_mm256_set1_ps(200.f), _mm256_sub_ps(fy, fz)));
+    }
+#endif
+    for(; i < n; ++i) {
+        const float lr = gamma_lookup(to_linear, r[i]);
+        const float lg = gamma_lookup(to_linear, g[i]);
+        const float lb = gamma_lookup(to_linear, b[i]);
+        const float x = (0.4124564f*lr + 0.3575761f*lg + 0.1804375f*lb) / WHITE_X;
+        const float y = (0.2126729f*lr + 0.7151522f*lg + 0.0721750f*lb) / WHITE_Y;
+        const float z = (0.0193339f*lr + 0.1191920f*lg + 0.9503041f*lb) / WHITE_Z;
+        const float fx = lab_f(x), fy = lab_f(y), fz = lab_f(z);
+        L[i] = 116.f*fy - 16.f;
+        A[i] = 500.f*(fx - fy);
+        B[i] = 200.f*(fy - fz);
+    }
+}
+
+static void lab_to_rgb_block(const float* __restrict L, const float* __restrict A, const float* __restrict B,
+                             float* __restrict r, float* __restrict g, float* __restrict b, int n)
+{
+    const float* __restrict to_srgb = get_gamma_tables().to_srgb;
+    int i = 0;
+#ifdef COLOR_UTILS_AVX2
+    for(; i + 8 <= n; i += 8) {
+        const __m256 fy = _mm256_div_ps(_mm256_add_ps(_mm256_loadu_ps(L + i), _mm256_set1_ps(16.f)), _mm256_set1_ps(116.f));
+        const __m256 fx = _mm256_add_ps(fy, _mm256_div_ps(_mm256_loadu_ps(A + i), _mm256_set1_ps(500.f)));
+        const __m256 fz = _mm256_sub_ps(fy, _mm256_div_ps(_mm256_loadu_ps(B + i), _mm256_set1_ps(200.f)));
+        const __m256 x = _mm256_mul_ps(lab_f_inv8(fx), _mm256_set1_ps(WHITE_X));
+        const __m256 y = _mm256_mul_ps(lab_f_inv8(fy), _mm256_set1_ps(WHITE_Y));
+        const __m256 z = _mm256_mul_ps(lab_f_inv8(fz), _mm256_set1_ps(WHITE_Z));
+        _mm256_storeu_ps(r + i, gamma_lookup8(to_srgb, dot3( 3.2404542f, x, -1.5371385f, y, -0.4985314f, z)));
+        _mm256_storeu_ps(g + i, gamma_lookup8(to_srgb, dot3(-0.9692660f, x,  1.8760108f, y,  0.0415560f, z)));
+        _mm256_storeu_ps(b + i, gamma_lookup8(to_srgb, dot3( 0.0556434f, x, -0.2040259f, y,  1.0572252f, z)));
+    }
+#endif
+    for(; i < n; ++i) {
+        const float fy = (L[i] + 16.f) / 116.f, fx = fy + A[i] / 500.f, fz = fy - B[i] / 200.f;
+        const float x = lab_f_inv(fx) * WHITE_X, y = lab_f_inv(fy) * WHITE_Y, z = lab_f_inv(fz) * WHITE_Z;
+        r[i] = gamma_lookup(to_srgb,  3.2404542f*x - 1.5371385f*y - 0.4985314f*z);
+        g[i] = gamma_lookup(to_srgb, -0.9692660f*x + 1.8760108f*y + 0.0415560f*z);
+        b[i] = gamma_lookup(to_srgb,  0.0556434f*x - 0.2040259f*y + 1.0572252f*z);
+    }
+}
+
+static void rgb_to_ycbcr_block(const float* __restrict r, const float* __restrict g, const float* __restrict b,
+                               float* __restrict y, float* __restrict cb, float* __restrict cr, int n)
+{
+    for(int i = 0; i < n; ++i) {
+        y[i]  =        0.299f*r[i]    + 0.587f*g[i]    + 0.114f*b[i];
+        cb[i] = 0.5f - 0.168736f*r[i] - 0.331264f*g[i] + 0.5f*b[i];
+        cr[i] = 0.5f + 0.5f*r[i]      - 0.418688f*g[i] - 0.081312f*b[i];
+    }
+}
+
+static void ycbcr_to_rgb_block(const float* __restrict y, const float* __restrict cb, const float* __restrict cr,
+                               float* __restrict r, float* __restrict g, float* __restrict b, int n)
+{
+    for(int i = 0; i < n; ++i) {
+        const float u = cb[i] - 0.5f, v = cr[i] - 0.5f;
+        r[i] = y[i] + 1.402f*v;
+        g[i] = y[i] - 0.344136f*u - 0.714136f*v;
+        b[i] = y[i] + 1.772f*u;
+    }
+}
+
+void rgb_to_lab_image(const image_t& in, image_t* out)
+{
+    get_gamma_tables();
+    convert_planes(in, out, rgb_to_lab_block);
+}
+
+void lab_to_rgb_image(const image_t& in, image_t* out)
+{
+    get_gamma_tables();
+    convert_planes(in, out, lab_to_rgb_block);
+}
+
+void rgb_to_ycbcr_image(const image_t& in, image_t* out)
+{
+    convert_planes(in, out, rgb_to_ycbcr_block);
+}
+
+void ycbcr_to_rgb_image(const image_t& in, image_t* out)
+{
+    convert_planes(in, out, ycbcr_to_rgb_block);
+}
+
+void convert_color_space(const image_t& in, image_t* out, color_space_t from, color_space_t to)
+{
+    if(from == to) {
+        copy_image(in, out);
+        return;
+    }
+    // everything goes through rgb
+    image_t rgb;
+    switch(from) {
+        case COLOR_SPACE_RGB: rgb = in; break;
+        case COLOR_SPACE_HSV: hsv_to_rgb_image(in, &rgb); break;
+        case COLOR_SPACE_LAB: lab_to_rgb_image(in, &rgb); break;
+        case COLOR_SPACE_YCBCR: ycbcr_to_rgb_image(in, &rgb); break;
+    }
+    switch(to) {
+        case COLOR_SPACE_RGB: *out = rgb; break;
+        case COLOR_SPACE_HSV: rgb_to_hsv_image(rgb, out); break;
+        case COLOR_SPACE_LAB: rgb_to_lab_image(rgb, out); break;
+        case COLOR_SPACE_YCBCR: rgb_to_ycbcr_image(rgb, out); break;
+    }
+}
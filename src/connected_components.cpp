@@ -1,61 +1,413 @@
 #include "connected_components.h"
+#include "color_utils.h"
 
-#include <queue>
+#include "thread_pool.h"
 
-void connected_components_bfs(const image_t& binary, const std::vector<std::pair<int,int> >& points, std::vector<int>* label) 
+#include <algorithm>
+#include <atomic>
+
+// union-find over provisional labels. Roots are always the smallest label of their set, so every
+// parent index is smaller than its child and the relabel pass can run in a single forward sweep.
+// Within a strip only one thread touches the labels, so relaxed loads and stores are enough there.
+static inline int find_root(std::atomic<int>* parent, int i)
+{
+    int root = i;
+    while (parent[root].load(std::memory_order_relaxed) != root) root = parent[root].load(std::memory_order_relaxed);
+    while (i != root) {
+        int next = parent[i].load(std::memory_order_relaxed);
+        parent[i].store(root, std::memory_order_relaxed);
+        i = next;
+    }
+    return root;
+}
+
+static inline int find_root(std::vector<int>& parent, int i)
 {
-    *label = std::vector<int>(binary.w*binary.h, -1);
+    int root = i;
+    while (parent[root] != root) root = parent[root];
+    while (i != root) {
+        int next = parent[i];
+        parent[i] = root;
+        i = next;
+    }
+    return root;
+}
+
+static inline int merge(std::atomic<int>* parent, int a, int b)
+{
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b) { parent[b].store(a, std::memory_order_relaxed); return a; }
+    parent[a].store(b, std::memory_order_relaxed);
+    return b;
+}
+
+// lock-free union for the strip borders: the larger root is linked below the smaller one only if it
+// is still a root, otherwise another thread got there first and the roots are looked up again
+static void merge_atomic(std::atomic<int>* parent, int a, int b)
+{
+    for (;;) {
+        while (parent[a].load() != a) a = parent[a].load();
+        while (parent[b].load() != b) b = parent[b].load();
+        if (a == b) return;
+        if (a > b) std::swap(a, b);
+        int expected = b;
+        if (parent[b].compare_exchange_weak(expected, a)) return;
+    }
+}
+
+// labels rows [y0, y1) as if nothing was above them, new labels are taken from next upwards.
+// Returns one past the last label used
+static int label_strip(const image_t& binary, int y0, int y1, int next, int* prov, const int* zero_row, std::atomic<int>* parent)
+{
+    const int w = binary.w, stride = w + 2;
+    for (int y = y0; y < y1; ++y) {
+        const float* src = &binary.data[y*w];
+        int* row = &prov[y*stride + 1];
+        const int* up = y == y0 ? zero_row + 1 : row - stride;
+        for (int x = 0; x < w; ++x) {
+            if (src[x] <= 0.f) continue;
+            // decision tree over the scanned neighbours p q r / s x: q touches all of them, and
+            // only r needs a merge with p or s because they are not adjacent to it
+            if (up[x]) {
+                row[x] = up[x];
+            } else if (up[x+1]) {
+                if (up[x-1]) row[x] = merge(parent, up[x+1], up[x-1]);
+                else if (row[x-1]) row[x] = merge(parent, up[x+1], row[x-1]);
+                else row[x] = up[x+1];
+            } else if (up[x-1]) {
+                row[x] = up[x-1];
+            } else if (row[x-1]) {
+                row[x] = row[x-1];
+            } else {
+                row[x] = next;
+                parent[next].store(next, std::memory_order_relaxed);
+                next++;
+            }
+        }
+    }
+    return next;
+}
+
+int label_components(const image_t& binary, std::vector<int>* label)
+{
+    const int w = binary.w, h = binary.h, stride = w + 2;
+    // provisional labels with a zero column on each side, 0 is background
+    std::vector<int> prov(stride*h, 0), zero_row(stride, 0);
+
+    // a few strips per thread, every strip owns a label range large enough for a checkerboard
+    const int num_strips = std::max(1, std::min(4*get_num_threads(), h / 32));
+    std::vector<int> strip_y(num_strips+1), strip_base(num_strips+1), strip_next(num_strips);
+    strip_base[0] = 1;
+    for (int s = 0; s <= num_strips; ++s) strip_y[s] = (long long)h*s/num_strips;
+    for (int s = 0; s < num_strips; ++s) {
+        strip_base[s+1] = strip_base[s] + ((strip_y[s+1] - strip_y[s] + 1)/2) * ((w + 1)/2);
+    }
+    std::vector<std::atomic<int> > parent(strip_base[num_strips]);
+    parent[0] = 0;
+
+    parallel_for(num_strips, [&](int start, int end) {
+        for (int s = start; s < end; ++s) {
+            strip_next[s] = label_strip(binary, strip_y[s], strip_y[s+1], strip_base[s], &prov[0], &zero_row[0], &parent[0]);
+        }
+    }, 1);
+
+    // stitch every strip to the one above along their shared border
+    parallel_for(num_strips - 1, [&](int start, int end) {
+        for (int s = start + 1; s < end + 1; ++s) {
+            const int* row = &prov[strip_y[s]*stride + 1];
+            const int* up = row - stride;
+            for (int x = 0; x < w; ++x) {
+                if (!row[x]) continue;
+                if (up[x]) {
+                    merge_atomic(&parent[0], row[x], up[x]);
+                } else {
+                    if (up[x-1]) merge_atomic(&parent[0], row[x], up[x-1]);
+                    if (up[x+1]) merge_atomic(&parent[0], row[x], up[x+1]);
+                }
+            }
+        }
+    }, 1);
+
+    // flatten: roots get consecutive ids in scan order, every other label takes its parent's id.
+    // Strips hand out increasing label ranges, so this matches a sequential scan exactly
     int count = 0;
-    for (int i = 0; i < points.size(); ++i) {
-        std::pair<int,int> root = points[i];
-        int root_point = root.second*binary.w + root.first;
-
-        if ((*label)[root_point] == -1) {
-            std::queue<int> queue;
-            queue.push(root_point);
-            while (!queue.empty()) {
-                // extract from queue and grow component
-                int p = queue.front(); queue.pop();
-                if((*label)[p] != -1) continue;
-                (*label)[p] = count;
-
-                int neighbors[] = { p+binary.w, p-binary.w, p+1, p-1, p+1+binary.w, p-1+binary.w, p+1-binary.w, p-1-binary.w };
-                for (int q : neighbors) {
-                    if (binary.data[q] > 0.f && (*label)[q] == -1) {
-                        queue.push(q);
-                    }
+    for (int s = 0; s < num_strips; ++s) {
+        for (int l = strip_base[s]; l < strip_next[s]; ++l) {
+            const int p = parent[l].load(std::memory_order_relaxed);
+            parent[l].store(p == l ? count++ : parent[p].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+    label->resize(w*h);
+    parallel_for(h, [&](int start, int end) {
+        for (int y = start; y < end; ++y) {
+            const int* row = &prov[y*stride + 1];
+            int* dst = &(*label)[y*w];
+            for (int x = 0; x < w; ++x) dst[x] = row[x] ? parent[row[x]].load(std::memory_order_relaxed) : -1;
+        }
+    }, 64);
+    return count;
+}
+
+// Ratio tests on r/n, g/n, b/n with n = r+g+b > 0 compare the same way without the division, so every
+// pixel is a handful of multiplies and compares. They run branch free over 64 pixels of the three
+// contiguous planes at a time and are packed straight into one mask word
+static void classify_ratios(const image_t& m, const cc_options_t& opt, binary_mask_t* mask)
+{
+    const int w = m.w, n = m.w*m.h;
+    const float r_n = 3*opt.r_n, g_n = 3*opt.g_n, b_n = 3*opt.b_n;
+    parallel_for(m.h, [&](int start, int end) {
+        for (int y = start; y < end; ++y) {
+            const float* R = &m.data[y*w];
+            const float* G = R + n;
+            const float* B = R + 2*n;
+            uint64_t* words = &mask->bits[y*mask->words_per_row];
+            for (int i = 0; i < mask->words_per_row; ++i) {
+                const int x0 = 64*i, len = std::min(64, w - x0);
+                unsigned char fg[64];
+                for (int k = 0; k < len; ++k) {
+                    const float r = R[x0+k], g = G[x0+k], b = B[x0+k], norm = r + g + b;
+                    const bool is_red   = (r > opt.r_g*g) & (r > opt.r_b*b) & (norm > r_n);
+                    const bool is_green = (g > opt.g_r*r) & (g > opt.g_b*b) & (norm > g_n);
+                    const bool is_blue  = (b > opt.b_r*r) & (b > opt.b_g*g) & (norm > b_n);
+                    fg[k] = (norm > 0.f) & (is_red | is_green | is_blue);
                 }
+                uint64_t word = 0;
+                for (int k = 0; k < len; ++k) word |= (uint64_t)fg[k] << k;
+                words[i] = word;
             }
-            count++;
         }
+    }, 16);
+}
+
+static void classify_hue(const image_t& m, const cc_options_t& opt, binary_mask_t* mask)
+{
+    image_t hsv;
+    rgb_to_hsv_image(m, &hsv);
+    const int w = m.w, n = m.w*m.h;
+    const bool wraps = opt.hue_min > opt.hue_max;
+    parallel_for(m.h, [&](int start, int end) {
+        for (int y = start; y < end; ++y) {
+            const float* H = &hsv.data[y*w];
+            const float* S = H + n;
+            const float* V = H + 2*n;
+            uint64_t* words = &mask->bits[y*mask->words_per_row];
+            for (int i = 0; i < mask->words_per_row; ++i) {
+                const int x0 = 64*i, len = std::min(64, w - x0);
+                unsigned char fg[64];
+                for (int k = 0; k < len; ++k) {
+                    const float h = H[x0+k];
+                    const bool in_range = wraps ? (h >= opt.hue_min) | (h <= opt.hue_max) : (h >= opt.hue_min) & (h <= opt.hue_max);
+                    fg[k] = in_range & (S[x0+k] >= opt.min_saturation) & (V[x0+k] >= opt.min_value);
+                }
+                uint64_t word = 0;
+                for (int k = 0; k < len; ++k) word |= (uint64_t)fg[k] << k;
+                words[i] = word;
+            }
+        }
+    }, 16);
+}
+
+// runs of rows y-1 and y are 8-connected if they overlap after growing one of them by a pixel on each
+// side. Both rows are sorted, so a single merge-like sweep finds all the overlaps
+template <typename Merge>
+static void merge_run_rows(const run_mask_t& runs, int y, Merge merge_runs)
+{
+    int j = runs.row_start[y-1];
+    const int prev_end = runs.row_start[y];
+    for (int i = runs.row_start[y]; i < runs.row_start[y+1]; ++i) {
+        const run_t& a = runs.runs[i];
+        while (j < prev_end && runs.runs[j].x1 < a.x0) ++j;
+        for (int k = j; k < prev_end && runs.runs[k].x0 <= a.x1; ++k) merge_runs(i, k);
     }
 }
 
-std::vector<int> connected_components(const image_t& m, cc_options_t opt, std::vector<std::pair<int,int> >* points)
+// Same scheme as label_components with runs in place of pixels: strips of rows are labeled independently,
+// their borders stitched with merge_atomic and the roots numbered in parallel. Runs are stored in scan
+// order, so every strip owns a contiguous range of run indices and no label ranges have to be reserved
+int label_runs(const run_mask_t& runs, std::vector<int>* label)
+{
+    const int n = runs.runs.size(), h = runs.h;
+    std::vector<std::atomic<int> > parent(n);
+
+    const int num_strips = std::max(1, std::min(4*get_num_threads(), h / 32));
+    std::vector<int> strip_y(num_strips+1);
+    for (int s = 0; s <= num_strips; ++s) strip_y[s] = (long long)h*s/num_strips;
+
+    parallel_for(num_strips, [&](int start, int end) {
+        for (int s = start; s < end; ++s) {
+            for (int i = runs.row_start[strip_y[s]]; i < runs.row_start[strip_y[s+1]]; ++i) {
+                parent[i].store(i, std::memory_order_relaxed);
+            }
+            for (int y = strip_y[s] + 1; y < strip_y[s+1]; ++y) {
+                merge_run_rows(runs, y, [&](int a, int b) { merge(&parent[0], a, b); });
+            }
+        }
+    }, 1);
+
+    // stitch every strip to the one above along their shared border
+    parallel_for(num_strips - 1, [&](int start, int end) {
+        for (int s = start + 1; s < end + 1; ++s) {
+            merge_run_rows(runs, strip_y[s], [&](int a, int b) { merge_atomic(&parent[0], a, b); });
+        }
+    }, 1);
+
+    // point every run straight at its root and count the roots of every strip. Parents are smaller
+    // indices, so within a strip they have already been pointed at their root
+    std::vector<int> strip_roots(num_strips + 1, 0);
+    parallel_for(num_strips, [&](int start, int end) {
+        for (int s = start; s < end; ++s) {
+            const int begin = runs.row_start[strip_y[s]];
+            for (int i = begin; i < runs.row_start[strip_y[s+1]]; ++i) {
+                int p = parent[i].load(std::memory_order_relaxed);
+                if (p == i) strip_roots[s+1]++;
+                else if (p >= begin) parent[i].store(parent[p].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                else parent[i].store(find_root(&parent[0], p), std::memory_order_relaxed);
+            }
+        }
+    }, 1);
+
+    // roots are the smallest run of their component, so numbering the roots of every strip from the
+    // number of roots in the strips above gives the ids of a sequential scan
+    for (int s = 0; s < num_strips; ++s) strip_roots[s+1] += strip_roots[s];
+    label->resize(n);
+    parallel_for(num_strips, [&](int start, int end) {
+        for (int s = start; s < end; ++s) {
+            const int begin = runs.row_start[strip_y[s]];
+            int id = strip_roots[s];
+            for (int i = begin; i < runs.row_start[strip_y[s+1]]; ++i) {
+                const int r = parent[i].load(std::memory_order_relaxed);
+                if (r == i) (*label)[i] = id++;
+                else if (r >= begin) (*label)[i] = (*label)[r];
+            }
+        }
+    }, 1);
+    // runs whose root lies in a strip above read its id once all of them are numbered
+    parallel_for(num_strips, [&](int start, int end) {
+        for (int s = start; s < end; ++s) {
+            const int begin = runs.row_start[strip_y[s]];
+            for (int i = begin; i < runs.row_start[strip_y[s+1]]; ++i) {
+                const int r = parent[i].load(std::memory_order_relaxed);
+                if (r < begin) (*label)[i] = (*label)[r];
+            }
+        }
+    }, 1);
+    return strip_roots[num_strips];
+}
+
+void compute_component_stats(const run_mask_t& runs, const std::vector<int>& label, int count, const image_t* color, component_stats_t* stats)
 {
-    points->clear();
-    image_t binary = make_image_grayscale(m.w, m.h);
-    std::vector<int> label(m.w*m.h,-1);
+    std::vector<double> sx(count, 0.0), sy(count, 0.0), sxx(count, 0.0), sxy(count, 0.0), syy(count, 0.0);
+    std::vector<double> sr(count, 0.0), sg(count, 0.0), sb(count, 0.0);
+    stats->count = count;
+    stats->area.assign(count, 0);
+    stats->x0.assign(count, runs.w);
+    stats->y0.assign(count, runs.h);
+    stats->x1.assign(count, -1);
+    stats->y1.assign(count, -1);
 
-    for (int y = 1; y < m.h - 1; ++y) {
-        for (int x = 1; x < m.w - 1; ++x) {
-            float r = get_pixel(m,x,y,0), g = get_pixel(m,x,y,1), b = get_pixel(m,x,y,2);
-            float norm = r + g + b;
-            if (norm > 0.0f) {
-                r /= norm, g /= norm, b /= norm;
+    const int n = runs.w*runs.h;
+    const bool has_color = color && color->c >= 3;
+    for (int y = 0; y < runs.h; ++y) {
+        for (int i = runs.row_start[y]; i < runs.row_start[y+1]; ++i) {
+            const int l = label[i];
+            if (l < 0) continue;
+            const int x0 = runs.runs[i].x0, x1 = runs.runs[i].x1 - 1, len = x1 - x0 + 1;
+            // sums of x and x^2 over [x0, x1]
+            const double run_sx = 0.5 * len * (x0 + x1);
+            const double run_sxx = ((double)x1*(x1+1)*(2*x1+1) - (double)(x0-1)*x0*(2*x0-1)) / 6.0;
 
-                bool is_red   = r > opt.r_g*g && r > opt.r_b*b && norm > opt.r_n*3;
-                bool is_green = g > opt.g_r*r && g > opt.g_b*b && norm > opt.g_n*3;
-                bool is_blue  = b > opt.b_r*r && b > opt.b_g*g && norm > opt.b_n*3;
+            stats->area[l] += len;
+            stats->x0[l] = std::min(stats->x0[l], x0);
+            stats->x1[l] = std::max(stats->x1[l], x1);
+            stats->y0[l] = std::min(stats->y0[l], y);
+            stats->y1[l] = std::max(stats->y1[l], y);
+            sx[l] += run_sx;
+            sy[l] += (double)len * y;
+            sxx[l] += run_sxx;
+            sxy[l] += run_sx * y;
+            syy[l] += (double)len * y * y;
 
-                set_pixel(&binary, x, y, 0, 0.f);
-                if (is_red || is_green || is_blue) {
-                    points->push_back({x, y});
-                    set_pixel(&binary, x, y, 0, 1.f);
+            if (has_color) {
+                const float* p = &color->data[y*runs.w];
+                float r = 0.f, g = 0.f, b = 0.f;
+                for (int x = x0; x <= x1; ++x) {
+                    r += p[x];
+                    g += p[n + x];
+                    b += p[2*n + x];
                 }
+                sr[l] += r;
+                sg[l] += g;
+                sb[l] += b;
             }
         }
     }
-    connected_components_bfs(binary, *points, &label);
+
+    stats->cx.resize(count); stats->cy.resize(count);
+    stats->mxx.resize(count); stats->mxy.resize(count); stats->myy.resize(count);
+    stats->r.resize(count); stats->g.resize(count); stats->b.resize(count);
+    for (int l = 0; l < count; ++l) {
+        const double a = std::max(stats->area[l], 1), cx = sx[l] / a, cy = sy[l] / a;
+        stats->cx[l] = cx;
+        stats->cy[l] = cy;
+        stats->mxx[l] = sxx[l] / a - cx*cx;
+        stats->mxy[l] = sxy[l] / a - cx*cy;
+        stats->myy[l] = syy[l] / a - cy*cy;
+        stats->r[l] = sr[l] / a;
+        stats->g[l] = sg[l] / a;
+        stats->b[l] = sb[l] / a;
+    }
+}
+
+int filter_components_by_area(std::vector<int>* label, component_stats_t* stats, int min_area)
+{
+    std::vector<int> remap(stats->count, -1);
+    int count = 0;
+    for (int l = 0; l < stats->count; ++l) {
+        if (stats->area[l] < min_area) continue;
+        remap[l] = count;
+        // compact every column of the table in place, count <= l
+        stats->area[count] = stats->area[l];
+        stats->x0[count] = stats->x0[l]; stats->y0[count] = stats->y0[l];
+        stats->x1[count] = stats->x1[l]; stats->y1[count] = stats->y1[l];
+        stats->cx[count] = stats->cx[l]; stats->cy[count] = stats->cy[l];
+        stats->mxx[count] = stats->mxx[l]; stats->mxy[count] = stats->mxy[l]; stats->myy[count] = stats->myy[l];
+        stats->r[count] = stats->r[l]; stats->g[count] = stats->g[l]; stats->b[count] = stats->b[l];
+        count++;
+    }
+    for (int& l : *label) l = l < 0 ? -1 : remap[l];
+
+    stats->count = count;
+    stats->area.resize(count);
+    stats->x0.resize(count); stats->y0.resize(count); stats->x1.resize(count); stats->y1.resize(count);
+    stats->cx.resize(count); stats->cy.resize(count);
+    stats->mxx.resize(count); stats->mxy.resize(count); stats->myy.resize(count);
+    stats->r.resize(count); stats->g.resize(count); stats->b.resize(count);
+    return count;
+}
+
+std::vector<int> connected_components(const image_t& m, cc_options_t opt, run_mask_t* runs, component_stats_t* stats)
+{
+    binary_mask_t mask = make_binary_mask(m.w, m.h);
+    if (opt.mode == CC_CLASSIFY_HUE) classify_hue(m, opt, &mask);
+    else classify_ratios(m, opt, &mask);
+
+    if (opt.cleanup_radius > 0) {
+        binary_mask_t cleaned;
+        morphology_mask(mask, opt.cleanup_op, opt.cleanup_radius, opt.cleanup_radius, &cleaned);
+        mask.bits.swap(cleaned.bits);
+    }
+
+    std::vector<int> label;
+    *runs = make_run_mask(mask);
+    int count = label_runs(*runs, &label);
+
+    if (stats || opt.min_area > 0) {
+        component_stats_t local;
+        if (!stats) stats = &local;
+        compute_component_stats(*runs, label, count, &m, stats);
+        if (opt.min_area > 0) filter_components_by_area(&label, stats, opt.min_area);
+    }
     return label;
 }
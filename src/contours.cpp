@@ -0,0 +1,150 @@
+#include "contours.h"
+
+#include <cmath>
+
+// neighbour directions, counterclockwise on screen starting east: E NE N NW W SW S SE
+static const int dir_x[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int dir_y[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+
+void find_contours(const binary_mask_t& mask, std::vector<contour_t>* contours)
+{
+    contours->clear();
+    // one pixel frame of background so tracing never leaves the image. Pixels hold 1 for untouched
+    // foreground, and +-NBD once a border with number NBD passed through them
+    const int w = mask.w, h = mask.h, stride = w + 2;
+    std::vector<int> f(stride*(h+2), 0);
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) f[(y+1)*stride + x+1] = get_mask_bit(mask, x, y);
+    }
+    int offset[8];
+    for (int k = 0; k < 8; ++k) offset[k] = dir_y[k]*stride + dir_x[k];
+
+    // border numbers start at 2, the frame is border 1 and counts as a hole with no parent
+    int nbd = 1;
+    for (int y = 1; y <= h; ++y) {
+        int lnbd = 1;
+        for (int x = 1; x <= w; ++x) {
+            const int p = y*stride + x;
+            if (f[p] == 0) continue;
+
+            int from = -1;
+            bool is_hole = false;
+            if (f[p] == 1 && f[p-1] == 0) {
+                from = 4; // outer border, entered from the west
+            } else if (f[p] >= 1 && f[p+1] == 0) {
+                from = 0; // hole border, entered from the east
+                is_hole = true;
+                if (f[p] > 1) lnbd = f[p];
+            }
+
+            if (from >= 0) {
+                nbd++;
+                contour_t contour;
+                contour.is_hole = is_hole;
+                // the border met last on this row either surrounds the new one or is its sibling
+                const int last = lnbd - 2;
+                const bool last_is_hole = last < 0 ? true : (*contours)[last].is_hole;
+                if (is_hole == last_is_hole) contour.parent = last < 0 ? -1 : (*contours)[last].parent;
+                else contour.parent = last;
+
+                // look clockwise around p for the first foreground neighbour
+                int d = from, k = 0;
+                for (; k < 8; ++k, d = (d + 7) & 7) if (f[p + offset[d]]) break;
+
+                if (k == 8) {
+                    // isolated pixel
+                    f[p] = -nbd;
+                    contour.points.push_back({x-1, y-1});
+                } else {
+                    const int p1 = p + offset[d];
+                    int p2 = p1, p3 = p;
+                    for (;;) {
+                        contour.points.push_back({p3 % stride - 1, p3 / stride - 1});
+                        // look counterclockwise around p3, starting after the pixel we came from
+                        int d3 = 0;
+                        for (int j = 0; j < 8; ++j) if (p3 + offset[j] == p2) d3 = j;
+                        bool east_is_background = false;
+                        int p4 = p2;
+                        for (int j = 1; j <= 8; ++j) {
+                            const int dj = (d3 + j) & 7;
+                            const int q = p3 + offset[dj];
+                            if (f[q]) { p4 = q; break; }
+                            if (dj == 0) east_is_background = true;
+                        }
+                        if (east_is_background) f[p3] = -nbd;
+                        else if (f[p3] == 1) f[p3] = nbd;
+
+                        if (p4 == p && p3 == p1) break;
+                        p2 = p3;
+                        p3 = p4;
+                    }
+                }
+                contours->push_back(contour);
+            }
+            if (f[p] != 1) lnbd = std::abs(f[p]);
+        }
+    }
+}
+
+// distance of p from the line through a and b, or from a if they coincide
+static float line_distance(contour_point_t p, contour_point_t a, contour_point_t b)
+{
+    const float dx = b.x - a.x, dy = b.y - a.y;
+    const float len = sqrtf(dx*dx + dy*dy);
+    if (len == 0.f) return sqrtf((float)(p.x - a.x)*(p.x - a.x) + (float)(p.y - a.y)*(p.y - a.y));
+    return fabsf(dx*(p.y - a.y) - dy*(p.x - a.x)) / len;
+}
+
+void simplify_contour(const std::vector<contour_point_t>& in, float epsilon, contour_arena_t* arena, std::vector<contour_point_t>* out)
+{
+    const int n = in.size();
+    out->clear();
+    if (n < 3) {
+        out->assign(in.begin(), in.end());
+        return;
+    }
+
+    int far = 0, far_dist = -1;
+    for (int i = 1; i < n; ++i) {
+        const int dx = in[i].x - in[0].x, dy = in[i].y - in[0].y;
+        if (dx*dx + dy*dy > far_dist) { far_dist = dx*dx + dy*dy; far = i; }
+    }
+
+    // index n stands for point 0 again, closing the polygon
+    std::vector<unsigned char>& keep = arena->keep;
+    std::vector<std::pair<int,int> >& stack = arena->stack;
+    keep.assign(n, 0);
+    keep[0] = keep[far] = 1;
+    stack.clear();
+    stack.push_back({0, far});
+    stack.push_back({far, n});
+    while (!stack.empty()) {
+        const int a = stack.back().first, b = stack.back().second;
+        stack.pop_back();
+        if (b - a < 2) continue;
+
+        const contour_point_t pa = in[a], pb = in[b % n];
+        int best = -1;
+        float best_dist = epsilon;
+        for (int i = a + 1; i < b; ++i) {
+            const float dist = line_distance(in[i], pa, pb);
+            if (dist > best_dist) { best_dist = dist; best = i; }
+        }
+        if (best < 0) continue;
+        keep[best] = 1;
+        stack.push_back({a, best});
+        stack.push_back({best, b});
+    }
+
+    for (int i = 0; i < n; ++i) if (keep[i]) out->push_back(in[i]);
+}
+
+void simplify_contours(std::vector<contour_t>* contours, float epsilon)
+{
+    contour_arena_t arena;
+    std::vector<contour_point_t> simplified;
+    for (contour_t& contour : *contours) {
+        simplify_contour(contour.points, epsilon, &arena, &simplified);
+        contour.points.swap(simplified);
+    }
+}
@@ -0,0 +1,153 @@
+#include "distance_kernels.h"
+
+#include <algorithm>
+#include <cassert>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define DISTANCE_KERNELS_AVX2
+#endif
+
+center_block_t make_center_block(const matrix_t& centers, int from, int to)
+{
+    if(to < 0) to = centers.rows;
+    center_block_t block;
+    block.k = to - from;
+    block.d = centers.cols;
+    block.stride = (block.k + 7) & ~7;
+    // padding lanes hold ones so the IoU kernel never divides by zero
+    block.vals.assign(block.d*block.stride, 1.f);
+    for(int c = 0; c < block.k; ++c) {
+        const std::vector<float>& center = centers.vals[from + c];
+        for(int j = 0; j < block.d; ++j) block.vals[j*block.stride + c] = center[j];
+    }
+    return block;
+}
+
+// Every lane accumulates over the coordinates in order with madd, the same arithmetic as dist()
+template<kmeans_metric_t metric>
+static void distances_scalar(const float* x, const center_block_t& centers, int c0, float* out)
+{
+    const int k = centers.k, stride = centers.stride;
+    const float* vals = centers.vals.data();
+    if(metric == IOU) {
+        const float* w = vals;
+        const float* h = vals + stride;
+        for(int c = c0; c < k; ++c) {
+            const float min_w = std::min(x[0], w[c]), min_h = std::min(x[1], h[c]);
+            const float inter = min_w * min_h;
+            // written as explicit multiply-adds so the compiler has nothing left to contract differently
+            const float uni = madd(-min_w, min_h, madd(w[c], h[c], x[0]*x[1]));
+            out[c] = 1.f - inter / uni;
+        }
+        return;
+    }
+    for(int c = c0; c < k; ++c) out[c] = 0.f;
+    for(int j = 0; j < centers.d; ++j) {
+        const float xj = x[j];
+        const float* row = vals + j*stride;
+        for(int c = c0; c < k; ++c) {
+            const float diff = xj - row[c];
+            if(metric == L2) out[c] = madd(diff, diff, out[c]);
+            else out[c] += fabsf(diff);
+        }
+    }
+}
+
+#ifdef DISTANCE_KERNELS_AVX2
+template<kmeans_metric_t metric>
+static void distances_avx2(const float* x, const center_block_t& centers, float* out)
+{
+    const int stride = centers.stride, full = centers.k & ~7;
+    const float* vals = centers.vals.data();
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    for(int c = 0; c < full; c += 8) {
+        __m256 acc;
+        if(metric == IOU) {
+            const __m256 w = _mm256_loadu_ps(vals + c), h = _mm256_loadu_ps(vals + stride + c);
+            const __m256 min_w = _mm256_min_ps(_mm256_set1_ps(x[0]), w);
+            const __m256 min_h = _mm256_min_ps(_mm256_set1_ps(x[1]), h);
+            const __m256 inter = _mm256_mul_ps(min_w, min_h);
+            const __m256 uni = _mm256_fnmadd_ps(min_w, min_h, _mm256_fmadd_ps(w, h, _mm256_set1_ps(x[0]*x[1])));
+            acc = _mm256_sub_ps(_mm256_set1_ps(1.f), _mm256_div_ps(inter, uni));
+        }
+        else {
+            acc = _mm256_setzero_ps();
+            for(int j = 0; j < centers.d; ++j) {
+                const __m256 diff = _mm256_sub_ps(_mm256_set1_ps(x[j]), _mm256_loadu_ps(vals + j*stride + c));
+                if(metric == L2) acc = _mm256_fmadd_ps(diff, diff, acc);
+                else acc = _mm256_add_ps(acc, _mm256_andnot_ps(sign, diff));
+            }
+        }
+        _mm256_storeu_ps(out + c, acc);
+    }
+    distances_scalar<metric>(x, centers, full, out);
+}
+#endif
+
+template<kmeans_metric_t metric>
+static void distances(const float* x, const center_block_t& centers, float* out)
+{
+#ifdef DISTANCE_KERNELS_AVX2
+    distances_avx2<metric>(x, centers, out);
+#else
+    distances_scalar<metric>(x, centers, 0, out);
+#endif
+}
+
+template<kmeans_metric_t metric>
+static int closest_center(const float* x, const center_block_t& centers, float* buffer, float* distance)
+{
+    distances<metric>(x, centers, buffer);
+    int best = 0;
+    for(int c = 1; c < centers.k; ++c) if(buffer[c] < buffer[best]) best = c;
+    // the square root is only taken for the winner
+    *distance = metric == L2 ? sqrtf(buffer[best]) : buffer[best];
+    return best;
+}
+
+template<kmeans_metric_t metric>
+static void closest_centers_impl(const matrix_t& data, int start, int end, const center_block_t& centers,
+                                 int* index, float* distance)
+{
+    std::vector<float> buffer(centers.stride);
+    for(int i = start; i < end; ++i) {
+        float d;
+        index[i - start] = closest_center<metric>(data.vals[i].data(), centers, buffer.data(), &d);
+        if(distance) distance[i - start] = d;
+    }
+}
+
+void center_distances(const float* x, const center_block_t& centers, kmeans_metric_t metric, float* out)
+{
+    switch(metric) {
+        case L1: distances<L1>(x, centers, out); break;
+        case L2: distances<L2>(x, centers, out); break;
+        case IOU: distances<IOU>(x, centers, out); break;
+    }
+}
+
+std::pair<int,float> get_closest_center(const float* x, const center_block_t& centers, kmeans_metric_t metric)
+{
+    assert(centers.k > 0);
+    std::vector<float> buffer(centers.stride);
+    float distance = 0.f;
+    int index = 0;
+    switch(metric) {
+        case L1: index = closest_center<L1>(x, centers, buffer.data(), &distance); break;
+        case L2: index = closest_center<L2>(x, centers, buffer.data(), &distance); break;
+        case IOU: index = closest_center<IOU>(x, centers, buffer.data(), &distance); break;
+    }
+    return std::make_pair(index, distance);
+}
+
+void closest_centers(const matrix_t& data, int start, int end, const center_block_t& centers, kmeans_metric_t metric,
+                     int* index, float* distance)
+{
+    assert(centers.k > 0 && data.cols == centers.d);
+    switch(metric) {
+        case L1: closest_centers_impl<L1>(data, start, end, centers, index, distance); break;
+        case L2: closest_centers_impl<L2>(data, start, end, centers, index, distance); break;
+        case IOU: closest_centers_impl<IOU>(data, start, end, centers, index, distance); break;
+    }
+}
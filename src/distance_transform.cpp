@@ -0,0 +1,93 @@
+#include "distance_transform.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// squared distance transform of the sampled function f of length n into d, v and z are scratch of n and n+1
+static void edt_1d(const float* f, int n, float* d, int* v, double* z)
+{
+    // lower envelope of the parabolas (q - i)^2 + f[i], v holds their vertices and z the boundaries
+    int k = 0;
+    v[0] = 0;
+    z[0] = -DISTANCE_INF;
+    z[1] = DISTANCE_INF;
+    for(int q = 1; q < n; ++q) {
+        // drop the parabolas the new one hides. z[0] = -INF stops the loop, since with f bounded by
+        // DISTANCE_INF the intersection is always larger than that. Double keeps q^2 exact on large images
+        double s = (((double)f[q] + (double)q*q) - ((double)f[v[k]] + (double)v[k]*v[k])) / (2.0*(q - v[k]));
+        while(s <= z[k]) {
+            k--;
+            s = (((double)f[q] + (double)q*q) - ((double)f[v[k]] + (double)v[k]*v[k])) / (2.0*(q - v[k]));
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k+1] = DISTANCE_INF;
+    }
+
+    k = 0;
+    for(int q = 0; q < n; ++q) {
+        while(z[k+1] < q) k++;
+        const float dq = q - v[k];
+        d[q] = dq*dq + f[v[k]];
+    }
+}
+
+// grid holds 0 for background and DISTANCE_INF for foreground and is replaced by the (squared) distances
+static void edt_2d(std::vector<float>* grid, int w, int h, bool squared)
+{
+    float* g = grid->data();
+
+    // columns: a thread copies 16 columns at a time into contiguous scratch, reading whole row segments
+    // instead of one float per cache line, transforms them and writes them back the same way
+    const int tile = 16;
+    parallel_for(w, [&](int start, int end) {
+        std::vector<float> f(tile*h), d(h);
+        std::vector<double> z(h+1);
+        std::vector<int> v(h);
+        for(int x0 = start; x0 < end; x0 += tile) {
+            const int n = std::min(tile, end - x0);
+            for(int y = 0; y < h; ++y) {
+                for(int i = 0; i < n; ++i) f[i*h + y] = g[y*w + x0 + i];
+            }
+            for(int i = 0; i < n; ++i) {
+                edt_1d(&f[i*h], h, d.data(), v.data(), z.data());
+                for(int y = 0; y < h; ++y) f[i*h + y] = d[y];
+            }
+            for(int y = 0; y < h; ++y) {
+                for(int i = 0; i < n; ++i) g[y*w + x0 + i] = f[i*h + y];
+            }
+        }
+    }, 16);
+
+    // rows are contiguous and are transformed in place through one scratch row
+    parallel_for(h, [&](int start, int end) {
+        std::vector<float> f(w);
+        std::vector<double> z(w+1);
+        std::vector<int> v(w);
+        for(int y = start; y < end; ++y) {
+            float* row = &g[y*w];
+            for(int x = 0; x < w; ++x) f[x] = row[x];
+            edt_1d(f.data(), w, row, v.data(), z.data());
+            if(!squared) for(int x = 0; x < w; ++x) row[x] = row[x] >= DISTANCE_INF ? DISTANCE_INF : sqrtf(row[x]);
+        }
+    }, 16);
+}
+
+void distance_transform(const image_t& binary, image_t* out, bool squared)
+{
+    *out = make_image_grayscale(binary.w, binary.h);
+    for(int i = 0; i < binary.w*binary.h; ++i) out->data[i] = binary.data[i] > 0.f ? DISTANCE_INF : 0.f;
+    edt_2d(&out->data, binary.w, binary.h, squared);
+}
+
+void distance_transform(const binary_mask_t& mask, image_t* out, bool squared)
+{
+    *out = make_image_grayscale(mask.w, mask.h);
+    for(int y = 0; y < mask.h; ++y) {
+        for(int x = 0; x < mask.w; ++x) out->data[y*mask.w + x] = get_mask_bit(mask, x, y) ? DISTANCE_INF : 0.f;
+    }
+    edt_2d(&out->data, mask.w, mask.h, squared);
+}
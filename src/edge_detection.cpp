@@ -0,0 +1,138 @@
+#include "edge_detection.h"
+#include "filter_image.h"
+#include "thread_pool.h"
+#include "utilities.h"
+
+#include <algorithm>
+#include <cmath>
+
+static inline unsigned char quantize_direction(float gx, float gy)
+{
+    // compare against tan(22.5) and tan(67.5) instead of calling atan2
+    float ax = fabsf(gx), ay = fabsf(gy);
+    if(ay <= 0.41421356f*ax) return EDGE_DIR_0;
+    if(ay >= 2.41421356f*ax) return EDGE_DIR_90;
+    return gx*gy > 0.f ? EDGE_DIR_45 : EDGE_DIR_135;
+}
+
+void sobel_image(const image_t& in, image_t* magnitude, std::vector<unsigned char>* direction, image_t* gx, image_t* gy)
+{
+    image_t gray;
+    if(in.c != 1) rgb_to_grayscale(in, &gray);
+    const image_t& src = in.c == 1 ? in : gray;
+    const int w = src.w, h = src.h;
+
+    *magnitude = make_image_grayscale(w, h);
+    if(direction) direction->assign(w*h, EDGE_DIR_0);
+    if(gx) *gx = make_image_grayscale(w, h);
+    if(gy) *gy = make_image_grayscale(w, h);
+
+    parallel_for(h, [&](int start, int end) {
+        for(int y = start; y < end; ++y) {
+            const float* up   = &src.data[std::max(y-1, 0)*w];
+            const float* mid  = &src.data[y*w];
+            const float* down = &src.data[std::min(y+1, h-1)*w];
+            float* mag_row = &magnitude->data[y*w];
+            float* gx_row = gx ? &gx->data[y*w] : NULL;
+            float* gy_row = gy ? &gy->data[y*w] : NULL;
+            unsigned char* dir_row = direction ? &(*direction)[y*w] : NULL;
+
+            auto sobel_at = [&](int x, int xl, int xr) {
+                float dx = (up[xr] + 2*mid[xr] + down[xr]) - (up[xl] + 2*mid[xl] + down[xl]);
+                float dy = (down[xl] + 2*down[x] + down[xr]) - (up[xl] + 2*up[x] + up[xr]);
+                mag_row[x] = sqrtf(dx*dx + dy*dy);
+                if(gx_row) gx_row[x] = dx;
+                if(gy_row) gy_row[x] = dy;
+                if(dir_row) dir_row[x] = quantize_direction(dx, dy);
+            };
+
+            sobel_at(0, 0, std::min(1, w-1));
+            for(int x = 1; x < w-1; ++x) sobel_at(x, x-1, x+1);
+            if(w > 1) sobel_at(w-1, w-2, w-1);
+        }
+    }, 16);
+}
+
+void non_max_suppression(const image_t& magnitude, const std::vector<unsigned char>& direction, image_t* out)
+{
+    const int w = magnitude.w, h = magnitude.h;
+    // neighbour offsets along the gradient for every edge_direction_t
+    static const int offsets[4][2] = { {1, 0}, {1, 1}, {0, 1}, {1, -1} };
+    *out = make_image_grayscale(w, h);
+
+    parallel_for(h, [&](int start, int end) {
+        for(int y = start; y < end; ++y) {
+            for(int x = 0; x < w; ++x) {
+                const int i = y*w + x;
+                const float m = magnitude.data[i];
+                if(m == 0.f) continue;
+
+                const int dx = offsets[direction[i]][0], dy = offsets[direction[i]][1];
+                const int ax = x + dx, ay = y + dy, bx = x - dx, by = y - dy;
+                float a = (ax >= 0 && ax < w && ay >= 0 && ay < h) ? magnitude.data[ay*w + ax] : 0.f;
+                float b = (bx >= 0 && bx < w && by >= 0 && by < h) ? magnitude.data[by*w + bx] : 0.f;
+
+                // strict on one side only, so plateaus keep exactly one pixel
+                if(m > a && m >= b) out->data[i] = m;
+            }
+        }
+    }, 16);
+}
+
+void hysteresis_threshold(const image_t& in, float low, float high, image_t* edges)
+{
+    const int w = in.w, h = in.h;
+    *edges = make_image_grayscale(w, h);
+
+    // strong pixels seed the work queue, weak pixels are only reached through it
+    std::vector<int> queue;
+    for(int i = 0; i < w*h; ++i) {
+        if(in.data[i] >= high) {
+            edges->data[i] = 1.f;
+            queue.push_back(i);
+        }
+    }
+
+    while(!queue.empty()) {
+        const int p = queue.back(); queue.pop_back();
+        const int x = p % w, y = p / w;
+        for(int dy = -1; dy <= 1; ++dy) {
+            const int ny = y + dy;
+            if(ny < 0 || ny >= h) continue;
+            for(int dx = -1; dx <= 1; ++dx) {
+                const int nx = x + dx;
+                if(nx < 0 || nx >= w) continue;
+                const int q = ny*w + nx;
+                if(edges->data[q] == 0.f && in.data[q] >= low) {
+                    edges->data[q] = 1.f;
+                    queue.push_back(q);
+                }
+            }
+        }
+    }
+}
+
+image_t canny_image(const image_t& in, const canny_options_t& opt, canny_timings_t* timings)
+{
+    double t0 = time_now();
+    image_t gray, blurred;
+    rgb_to_grayscale(in, &gray);
+    gaussian_blur_image(gray, opt.sigma, &blurred);
+
+    double t1 = time_now();
+    image_t magnitude;
+    std::vector<unsigned char> direction;
+    sobel_image(blurred, &magnitude, &direction);
+
+    double t2 = time_now();
+    image_t thin;
+    non_max_suppression(magnitude, direction, &thin);
+
+    double t3 = time_now();
+    image_t edges;
+    hysteresis_threshold(thin, opt.low_threshold, opt.high_threshold, &edges);
+    double t4 = time_now();
+
+    if(timings) *timings = { t1 - t0, t2 - t1, t3 - t2, t4 - t3 };
+    return edges;
+}
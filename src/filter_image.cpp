@@ -1,7 +1,12 @@
 #include "filter_image.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 #include <cmath>
+#include <cstdint>
+#include <functional>
 
 filter_type_t get_filter_type(const char* s) 
 {
@@ -17,9 +22,16 @@ filter_type_t get_filter_type(const char* s)
     if(strcmp(s, "sharpen") == 0) return SHARPEN;
     if(strcmp(s, "smoothen") == 0) return SMOOTHEN;
     if(strcmp(s, "gaussian") == 0) return GAUSSIAN;
+    if(strcmp(s, "median") == 0) return MEDIAN;
+    if(strcmp(s, "bilateral") == 0) return BILATERAL;
     return GAUSSIAN;
 }
 
+bool is_nonlinear_filter(filter_type_t filter_type)
+{
+    return filter_type == MEDIAN || filter_type == BILATERAL;
+}
+
 image_t get_filter(filter_type_t filter_type) 
 {
     switch(filter_type) {
@@ -47,10 +59,20 @@ image_t get_filter(filter_type_t filter_type)
             return make_smoothing_filter();
         case GAUSSIAN:
             return make_gaussian_filter();
+        case MEDIAN:
+        case BILATERAL:
+            return make_identity_filter();
     }
     return make_image(3,3,1);
 }
 
+image_t make_identity_filter()
+{
+    image_t f = make_image(3,3,1);
+    f.data[4] = 1;
+    return f;
+}
+
 image_t make_emboss_filter()
 {
     image_t f = make_image(3,3,1);
@@ -170,3 +192,236 @@ image_t make_gaussian_filter(float sigma)
     l1_normalize(&f);
     return f;
 }
+
+void gaussian_blur_image(const image_t& in, float sigma, image_t* out)
+{
+    if(sigma <= 0.f) {
+        copy_image(in, out);
+        return;
+    }
+    const int radius = std::max(1, (int)ceilf(3*sigma)), w = in.w, h = in.h;
+    std::vector<float> weights(2*radius+1);
+    float sum = 0.f;
+    for(int k = -radius; k <= radius; ++k) {
+        weights[k+radius] = expf(-(k*k) / (2*sigma*sigma));
+        sum += weights[k+radius];
+    }
+    for(float& weight : weights) weight /= sum;
+
+    image_t tmp = make_image(w, h, in.c);
+    *out = make_image(w, h, in.c);
+
+    // horizontal pass, every row of every channel is independent
+    parallel_for(h*in.c, [&](int start, int end) {
+        for(int row = start; row < end; ++row) {
+            const float* src = &in.data[row*w];
+            float* dst = &tmp.data[row*w];
+            for(int x = 0; x < w; ++x) {
+                float val = 0.f;
+                if(x >= radius && x < w - radius) {
+                    for(int k = 0; k <= 2*radius; ++k) val += weights[k]*src[x-radius+k];
+                }
+                else {
+                    for(int k = 0; k <= 2*radius; ++k) val += weights[k]*src[std::min(std::max(x-radius+k, 0), w-1)];
+                }
+                dst[x] = val;
+            }
+        }
+    }, 8);
+
+    // vertical pass, accumulates whole rows so the inner loop runs over contiguous memory
+    parallel_for(h*in.c, [&](int start, int end) {
+        for(int row = start; row < end; ++row) {
+            const int c = row / h, y = row % h;
+            float* dst = &out->data[row*w];
+            for(int k = 0; k <= 2*radius; ++k) {
+                const int sy = std::min(std::max(y-radius+k, 0), h-1);
+                const float* src = &tmp.data[(c*h + sy)*w];
+                const float weight = weights[k];
+                for(int x = 0; x < w; ++x) dst[x] += weight*src[x];
+            }
+        }
+    }, 8);
+}
+
+void median_filter_image(const image_t& in, int radius, image_t* out)
+{
+    assert(radius >= 1 && radius <= 127);
+    const int w = in.w, h = in.h, window = 2*radius+1;
+    const int rank = window*window / 2;
+    // columns are processed in tiles so the column histograms of a tile stay in cache,
+    // wide enough that setting up the kernel histogram at the start of every tile row stays cheap
+    const int tile_w = std::max(128, 8*window);
+    *out = make_image(w, h, in.c);
+
+    for(int k = 0; k < in.c; ++k) {
+        // quantize once, the histograms work on 8 bit values
+        std::vector<uint8_t> src(w*h);
+        for(int i = 0; i < w*h; ++i) {
+            float v = in.data[k*w*h + i];
+            src[i] = (uint8_t)(v <= 0.f ? 0 : v >= 1.f ? 255 : (int)(v*255.f + 0.5f));
+        }
+        float* dst = &out->data[k*w*h];
+
+        parallel_for(h, [&](int start, int end) {
+            // column histograms are split into 16 coarse bins and 256 fine bins
+            std::vector<uint16_t> col_fine((tile_w + 2*radius + 1)*256), col_coarse((tile_w + 2*radius + 1)*16);
+            std::vector<uint16_t> fine(256), coarse(16);
+
+            for(int x0 = 0; x0 < w; x0 += tile_w) {
+                const int x1 = std::min(x0 + tile_w, w);
+                const int lo = std::max(x0 - radius, 0), hi = std::min(x1 + radius, w-1);
+                std::fill(col_fine.begin(), col_fine.end(), 0);
+                std::fill(col_coarse.begin(), col_coarse.end(), 0);
+
+                auto add_row = [&](int y, int delta) {
+                    const uint8_t* row = &src[std::min(std::max(y, 0), h-1)*w];
+                    for(int x = lo; x <= hi; ++x) {
+                        col_fine[(x-lo)*256 + row[x]] += delta;
+                        col_coarse[(x-lo)*16 + (row[x] >> 4)] += delta;
+                    }
+                };
+                auto column = [&](int x) { return std::min(std::max(x, 0), w-1) - lo; };
+                // moves the kernel histogram one column to the right in a single vectorizable pass
+                auto slide_kernel = [&](int x_add, int x_remove) {
+                    const uint16_t* fa = &col_fine[column(x_add)*256];
+                    const uint16_t* fr = &col_fine[column(x_remove)*256];
+                    const uint16_t* ca = &col_coarse[column(x_add)*16];
+                    const uint16_t* cr = &col_coarse[column(x_remove)*16];
+                    for(int i = 0; i < 256; ++i) fine[i] += fa[i] - fr[i];
+                    for(int i = 0; i < 16; ++i) coarse[i] += ca[i] - cr[i];
+                };
+
+                for(int y = start - radius; y <= start + radius; ++y) add_row(y, 1);
+
+                for(int y = start; y < end; ++y) {
+                    if(y > start) {
+                        add_row(y - radius - 1, -1);
+                        add_row(y + radius, 1);
+                    }
+
+                    std::fill(fine.begin(), fine.end(), 0);
+                    std::fill(coarse.begin(), coarse.end(), 0);
+                    for(int x = x0 - radius; x <= x0 + radius; ++x) {
+                        const uint16_t* cf = &col_fine[column(x)*256];
+                        const uint16_t* cc = &col_coarse[column(x)*16];
+                        for(int i = 0; i < 256; ++i) fine[i] += cf[i];
+                        for(int i = 0; i < 16; ++i) coarse[i] += cc[i];
+                    }
+
+                    for(int x = x0; x < x1; ++x) {
+                        // find the coarse bin holding the median, then the exact value inside it.
+                        // Counting the prefix sums <= rank is branchless, which matters on noisy images
+                        int sum = 0, bin = 0;
+                        for(int i = 0; i < 16; ++i) {
+                            sum += coarse[i];
+                            bin += sum <= rank;
+                        }
+                        sum = 0;
+                        for(int i = 0; i < bin; ++i) sum += coarse[i];
+                        const uint16_t* fine_bin = &fine[bin*16];
+                        int value = 0;
+                        for(int i = 0; i < 16; ++i) {
+                            sum += fine_bin[i];
+                            value += sum <= rank;
+                        }
+                        dst[y*w + x] = (bin*16 + value) / 255.f;
+
+                        if(x + 1 < x1) slide_kernel(x + radius + 1, x - radius);
+                    }
+                }
+            }
+        }, 32);
+    }
+}
+
+void bilateral_filter_image(const image_t& in, float sigma_spatial, float sigma_range, image_t* out)
+{
+    const int w = in.w, h = in.h, c = in.c, stride = c + 1;
+    sigma_spatial = std::max(sigma_spatial, 1.f);
+    sigma_range = std::max(sigma_range, 1e-3f);
+
+    image_t guide;
+    rgb_to_grayscale(in, &guide);
+
+    // every cell holds the sum of each channel followed by the sum of weights
+    const int pad = 2;
+    const int gw = (int)((w-1) / sigma_spatial) + 1 + 2*pad;
+    const int gh = (int)((h-1) / sigma_spatial) + 1 + 2*pad;
+    const int gd = (int)(1.f / sigma_range) + 1 + 2*pad;
+    auto cell = [&](int gx, int gy, int gz) { return ((gy*gw + gx)*gd + gz)*stride; };
+    std::vector<float> grid(gw*gh*gd*stride, 0.f);
+
+    // splat with nearest neighbour, parallel over grid rows so no two threads write the same cell
+    parallel_for(gh, [&](int start, int end) {
+        int y0 = std::max(0, (int)ceilf((start - pad - 0.5f) * sigma_spatial));
+        int y1 = std::min(h, (int)ceilf((end - pad - 0.5f) * sigma_spatial));
+        for(int y = y0; y < y1; ++y) {
+            int gy = (int)(y / sigma_spatial + 0.5f) + pad;
+            if(gy < start || gy >= end) continue;
+            for(int x = 0; x < w; ++x) {
+                int gx = (int)(x / sigma_spatial + 0.5f) + pad;
+                int gz = (int)(guide.data[y*w + x] / sigma_range + 0.5f) + pad;
+                gz = std::min(std::max(gz, 0), gd-1);
+                float* g = &grid[cell(gx, gy, gz)];
+                for(int k = 0; k < c; ++k) g[k] += in.data[k*w*h + y*w + x];
+                g[c] += 1.f;
+            }
+        }
+    });
+
+    // blur the grid with a [1 4 6 4 1] / 16 kernel along each of its three axes
+    auto blur_axis = [&](int n, int lines, std::function<int(int,int)> index) {
+        parallel_for(lines, [&](int start, int end) {
+            std::vector<float> line(n*stride);
+            for(int l = start; l < end; ++l) {
+                for(int i = 0; i < n; ++i) {
+                    std::copy(&grid[index(l, i)], &grid[index(l, i)] + stride, &line[i*stride]);
+                }
+                for(int i = 0; i < n; ++i) {
+                    float* g = &grid[index(l, i)];
+                    for(int k = 0; k < stride; ++k) {
+                        float v = 6*line[i*stride+k];
+                        if(i > 0) v += 4*line[(i-1)*stride+k];
+                        if(i > 1) v += line[(i-2)*stride+k];
+                        if(i < n-1) v += 4*line[(i+1)*stride+k];
+                        if(i < n-2) v += line[(i+2)*stride+k];
+                        g[k] = v / 16.f;
+                    }
+                }
+            }
+        });
+    };
+    blur_axis(gd, gw*gh, [&](int l, int i) { return cell(l % gw, l / gw, i); });
+    blur_axis(gw, gh*gd, [&](int l, int i) { return cell(i, l / gd, l % gd); });
+    blur_axis(gh, gw*gd, [&](int l, int i) { return cell(l / gd, i, l % gd); });
+
+    // slice with trilinear interpolation
+    *out = make_image(w, h, c);
+    parallel_for(h, [&](int start, int end) {
+        std::vector<float> acc(stride);
+        for(int y = start; y < end; ++y) {
+            float fy = y / sigma_spatial + pad;
+            int gy = std::min((int)fy, gh-2);
+            float ty = fy - gy;
+            for(int x = 0; x < w; ++x) {
+                float fx = x / sigma_spatial + pad;
+                float fz = guide.data[y*w + x] / sigma_range + pad;
+                int gx = std::min((int)fx, gw-2);
+                int gz = std::min(std::max((int)fz, 0), gd-2);
+                float tx = fx - gx, tz = std::min(std::max(fz - gz, 0.f), 1.f);
+
+                std::fill(acc.begin(), acc.end(), 0.f);
+                for(int corner = 0; corner < 8; ++corner) {
+                    int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+                    float weight = (dx ? tx : 1-tx) * (dy ? ty : 1-ty) * (dz ? tz : 1-tz);
+                    const float* g = &grid[cell(gx+dx, gy+dy, gz+dz)];
+                    for(int k = 0; k < stride; ++k) acc[k] += weight*g[k];
+                }
+                for(int k = 0; k < c; ++k) {
+                    out->data[k*w*h + y*w + x] = acc[c] > 0.f ? acc[k] / acc[c] : in.data[k*w*h + y*w + x];
+                }
+            }
+        }
+    }, 16);
+}
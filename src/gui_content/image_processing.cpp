@@ -5,23 +5,55 @@ VDBB("Image processing");
     static GLenum data_format = GL_RGB;
     static image_t loaded_image = make_image(100,100,3);
     static image_t screen_image = copy_image(loaded_image);
+    static std::vector<contour_t> contours;
 
     constexpr int KERNEL_SIZE = 3;
     static bool preserve = false;
     static image_t filter = make_image(KERNEL_SIZE, KERNEL_SIZE, 1);
 
     bool load_button_pressed = colored_button("Load image", 0.125f);
+    ImGui::SameLine();
+    static int png_compression_level = 8;
+    ImGui::SliderInt("png compression", &png_compression_level, 1, 9);
+    ImGui::SameLine(); ShowHelpMarker("Lower levels encode faster but give larger files.");
+
+    // everything below works on loaded_image, which is a downscaled copy of full_image in preview mode
+    static image_t full_image = copy_image(loaded_image);
+    static bool preview = false;
+    static int preview_width = 800, resample_item = 1;
+    static const char* resample_items[] = { "bilinear", "bicubic", "lanczos" };
+    bool preview_changed = ImGui::Checkbox("Process at preview resolution", &preview);
+    if(preview) {
+        preview_changed |= ImGui::SliderInt("preview width", &preview_width, 64, 2048);
+        preview_changed |= ImGui::Combo("resampling", &resample_item, resample_items, IM_ARRAYSIZE(resample_items));
+    }
 
     const char* chosen_path = dialog.chooseFileDialog(load_button_pressed);
-    if(strcmp(chosen_path, "")) {
-        loaded_image = load_image_rgb(chosen_path);
+    bool image_loaded = strcmp(chosen_path, "") != 0;
+    if(image_loaded) {
+        full_image = load_image_rgb(chosen_path);
+    }
+    if(image_loaded || preview_changed) {
+        if(preview && full_image.w > preview_width) {
+            int preview_height = std::max(1, full_image.h * preview_width / full_image.w);
+            resize_image(full_image, preview_width, preview_height, &loaded_image, get_resample_filter(resample_items[resample_item]));
+        }
+        else {
+            loaded_image = copy_image(full_image);
+        }
         screen_image = copy_image(loaded_image);
-        save_image_png(screen_image, "lal");
+        contours.clear();
+        data_format = GL_RGB;
+    }
+    if(image_loaded) {
+        save_image_png_async(screen_image, "lal", png_compression_level);
     }
 
-    std::vector<unsigned char> image_data = get_hwc_bytes(screen_image);
+    static std::vector<unsigned char> image_data;
+    get_hwc_bytes(screen_image, &image_data);
     vdbSetTexture(0, image_data.data(), screen_image.w, screen_image.h, data_format, GL_UNSIGNED_BYTE);
     vdbDrawTexture(0);
+    draw_contours(contours, screen_image.w, screen_image.h);
 
     static float binary_threshold = 0.f, prev_binary_threshold = 0.f;
     if (ImGui::CollapsingHeader("Binary threshold")) {
@@ -32,6 +64,61 @@ VDBB("Image processing");
             data_format = GL_RGB;
         }
         prev_binary_threshold = binary_threshold;
+
+        if(colored_button("Otsu", 0.1f)) {
+            binary_threshold = prev_binary_threshold = 255.f * threshold_image_otsu(loaded_image, &screen_image);
+            data_format = GL_RGB;
+        }
+        ImGui::SameLine();
+        static int num_classes = 3;
+        if(colored_button("Multi-Otsu", 0.15f)) {
+            histogram_t hist = merge_histogram_channels(compute_histogram(loaded_image));
+            threshold_image(loaded_image, &screen_image, multi_otsu_thresholds(hist, num_classes));
+            data_format = GL_RGB;
+        }
+        ImGui::SameLine();
+        ImGui::SliderInt("classes", &num_classes, 2, 6);
+    }
+
+    if (ImGui::CollapsingHeader("Adaptive threshold")) {
+        static const char* adaptive_items[] = { "bradley", "sauvola" };
+        static int adaptive_item = 0, adaptive_radius = 15;
+        static float bradley_t = 0.15f, sauvola_k = 0.34f;
+        ImGui::Combo("method", &adaptive_item, adaptive_items, IM_ARRAYSIZE(adaptive_items));
+        ImGui::SliderInt("window radius", &adaptive_radius, 1, 200);
+        adaptive_threshold_type_t type = get_adaptive_threshold_type(adaptive_items[adaptive_item]);
+        if(type == ADAPTIVE_BRADLEY) ImGui::SliderFloat("bradley t", &bradley_t, 0.0f, 1.0f);
+        else ImGui::SliderFloat("sauvola k", &sauvola_k, 0.0f, 1.0f);
+
+        if(colored_button("Adaptive threshold", 0.2f)) {
+            if(type == ADAPTIVE_BRADLEY) adaptive_threshold_bradley(loaded_image, &screen_image, adaptive_radius, bradley_t);
+            else adaptive_threshold_sauvola(loaded_image, &screen_image, adaptive_radius, sauvola_k);
+            data_format = GL_LUMINANCE;
+        }
+    }
+
+    if (ImGui::CollapsingHeader("Distance transform")) {
+        static bool invert_mask = false;
+        static double distance_time = 0.0;
+        ImGui::Checkbox("distance of dark pixels", &invert_mask);
+        ImGui::SameLine(); ShowHelpMarker("The mask is the Otsu threshold of the grayscale image, distances are measured inside it.");
+        if(colored_button("Distance transform", 0.3f)) {
+            image_t gray, mask;
+            rgb_to_grayscale(loaded_image, &gray);
+            threshold_image_otsu(gray, &mask);
+            if(invert_mask) for(float& v : mask.data) v = 1.f - v;
+
+            double start = time_now();
+            distance_transform(mask, &screen_image);
+            distance_time = time_now() - start;
+
+            // scale to the largest finite distance for display
+            float max_dist = 0.f;
+            for(float v : screen_image.data) if(v < DISTANCE_INF) max_dist = std::max(max_dist, v);
+            for(float& v : screen_image.data) v = v >= DISTANCE_INF ? 1.f : (max_dist > 0.f ? v / max_dist : 0.f);
+            data_format = GL_LUMINANCE;
+        }
+        ImGui::Text("distance transform: %.2f ms", 1000*distance_time);
     }
 
     static float white_threshold_r, white_threshold_g, white_threshold_b, white_threshold_d = 255.f;
@@ -80,39 +167,174 @@ VDBB("Image processing");
     }
 
     if(ImGui::CollapsingHeader("Convolutions")) {
-        ImGui::SliderFloat3("",   &filter.data[0], -10.0f, 10.0f);
-        ImGui::SliderFloat3(" ",  &filter.data[KERNEL_SIZE], -10.0f, 10.0f);
-        ImGui::SliderFloat3("  ", &filter.data[2*KERNEL_SIZE], -10.0f, 10.0f);
+        static const char* items[] = { "emboss", "gx", "gy", "highpass", "box", "horizontal", "vertical", "right diagonal", "left diagonal", "sharpen", "smoothen", "gaussian", "median", "bilateral" };
+        static int curr_item = -1, prev_item = -1;
+        static filter_type_t filter_type = GAUSSIAN;
+        static int median_radius = 2;
+        static float bilateral_sigma_spatial = 8.f, bilateral_sigma_range = 25.f;
+        bool nonlinear = curr_item >= 0 && is_nonlinear_filter(filter_type);
 
-        if(colored_button("Convolve", 0.62f)) {
-            convolve_image(loaded_image, filter, &screen_image, preserve);
-            data_format = preserve ? GL_RGB : GL_LUMINANCE;
+        if(nonlinear && filter_type == MEDIAN) {
+            ImGui::SliderInt("median radius", &median_radius, 1, 127);
+        }
+        else if(nonlinear && filter_type == BILATERAL) {
+            ImGui::SliderFloat("spatial sigma", &bilateral_sigma_spatial, 1.0f, 64.0f);
+            ImGui::SliderFloat("range sigma", &bilateral_sigma_range, 1.0f, 255.0f);
+        }
+        else {
+            ImGui::SliderFloat3("",   &filter.data[0], -10.0f, 10.0f);
+            ImGui::SliderFloat3(" ",  &filter.data[KERNEL_SIZE], -10.0f, 10.0f);
+            ImGui::SliderFloat3("  ", &filter.data[2*KERNEL_SIZE], -10.0f, 10.0f);
         }
-        ImGui::SameLine();
-        ImGui::Checkbox("Preserve channel", &preserve);
 
-        static const char* items[] = { "emboss", "gx", "gy", "highpass", "box", "horizontal", "vertical", "right diagonal", "left diagonal", "sharpen", "smoothen", "gaussian" };
-        static int curr_item = -1, prev_item = -1;
+        if(colored_button(nonlinear ? "Filter" : "Convolve", 0.62f)) {
+            if(nonlinear && filter_type == MEDIAN) {
+                median_filter_image(loaded_image, median_radius, &screen_image);
+                data_format = GL_RGB;
+            }
+            else if(nonlinear && filter_type == BILATERAL) {
+                bilateral_filter_image(loaded_image, bilateral_sigma_spatial, bilateral_sigma_range / 255.f, &screen_image);
+                data_format = GL_RGB;
+            }
+            else {
+                convolve_image(loaded_image, filter, &screen_image, preserve);
+                data_format = preserve ? GL_RGB : GL_LUMINANCE;
+            }
+        }
+        if(!nonlinear) {
+            ImGui::SameLine();
+            ImGui::Checkbox("Preserve channel", &preserve);
+        }
 
         ImGui::Combo("predefined filters", &curr_item, items, IM_ARRAYSIZE(items));   // Combo using proper array. You can also pass a callback to retrieve array value, no need to create/copy an array just for that.
         if(curr_item != prev_item) {
-            filter_type_t f = get_filter_type(items[curr_item]);
-            filter = get_filter(f);
+            filter_type = get_filter_type(items[curr_item]);
+            filter = get_filter(filter_type);
         }
         prev_item = curr_item;
     }
 
+    if(ImGui::CollapsingHeader("Edge detection")) {
+        static canny_options_t canny_opt;
+        static canny_timings_t canny_timings = {0, 0, 0, 0};
+        static double sobel_time = 0;
+        ImGui::SliderFloat("canny sigma", &canny_opt.sigma, 0.0f, 5.0f);
+        ImGui::SliderFloat("canny low threshold", &canny_opt.low_threshold, 0.0f, 2.0f);
+        ImGui::SliderFloat("canny high threshold", &canny_opt.high_threshold, 0.0f, 2.0f);
+
+        if(colored_button("Sobel", 0.55f)) {
+            double start = time_now();
+            sobel_image(loaded_image, &screen_image, NULL);
+            sobel_time = time_now() - start;
+            data_format = GL_LUMINANCE;
+        }
+        ImGui::SameLine();
+        if(colored_button("Canny", 0.58f)) {
+            screen_image = canny_image(loaded_image, canny_opt, &canny_timings);
+            data_format = GL_LUMINANCE;
+        }
+        ImGui::Text("sobel: %.2f ms", 1000*sobel_time);
+        ImGui::Text("canny: blur %.2f ms, gradient %.2f ms, suppression %.2f ms, hysteresis %.2f ms",
+                    1000*canny_timings.blur, 1000*canny_timings.gradient,
+                    1000*canny_timings.suppression, 1000*canny_timings.hysteresis);
+    }
+
+    static bool use_hue_range = false;
+    static float hue_range[2] = {0.f, 30.f}, min_saturation = 0.3f, min_value = 0.2f;
+    if (ImGui::CollapsingHeader("Hue range")) {
+        ImGui::Checkbox("classify components by hue", &use_hue_range);
+        ImGui::SliderFloat2("hue range (degrees)", hue_range, 0.0f, 360.0f);
+        ImGui::SameLine(); ShowHelpMarker("A minimum larger than the maximum wraps around red.");
+        ImGui::SliderFloat("minimum saturation", &min_saturation, 0.0f, 1.0f);
+        ImGui::SliderFloat("minimum value", &min_value, 0.0f, 1.0f);
+    }
+
+    static const char* cleanup_items[] = { "none", "erode", "dilate", "open", "close" };
+    static int cleanup_item = 0, cleanup_radius = 1;
+    if (ImGui::CollapsingHeader("Component cleanup")) {
+        ImGui::Combo("cleanup before labeling", &cleanup_item, cleanup_items, IM_ARRAYSIZE(cleanup_items));
+        ImGui::SliderInt("cleanup radius", &cleanup_radius, 1, 32);
+        ImGui::SameLine(); ShowHelpMarker("Opening removes specks smaller than the structuring element, closing fills small holes.");
+    }
+
+    static bool find_outlines = false;
+    static float simplify_epsilon = 1.f;
+    if (ImGui::CollapsingHeader("Contours")) {
+        ImGui::Checkbox("trace component contours", &find_outlines);
+        ImGui::SliderFloat("simplify epsilon", &simplify_epsilon, 0.0f, 10.0f);
+        ImGui::SameLine(); ShowHelpMarker("Douglas-Peucker tolerance in pixels, 0 keeps every border pixel.");
+        int num_points = 0;
+        for (const contour_t& contour : contours) num_points += contour.points.size();
+        ImGui::Text("%d contours, %d points", (int)contours.size(), num_points);
+    }
+
+    static int min_area = 0;
+    static bool draw_boxes = false;
+    static component_stats_t stats = {0};
+    if (ImGui::CollapsingHeader("Component statistics")) {
+        ImGui::SliderInt("minimum area", &min_area, 0, 1000);
+        ImGui::Checkbox("draw bounding boxes", &draw_boxes);
+        ImGui::Text("%d components", stats.count);
+        for (int l = 0; l < std::min(stats.count, 10); ++l) {
+            ImGui::Text("%d: area %d, centroid (%.1f, %.1f), box %dx%d, mean rgb (%.2f, %.2f, %.2f)", l, stats.area[l],
+                        stats.cx[l], stats.cy[l], stats.x1[l] - stats.x0[l] + 1, stats.y1[l] - stats.y0[l] + 1,
+                        stats.r[l], stats.g[l], stats.b[l]);
+        }
+    }
+
+    static const int max_threads = get_num_threads();
+    static std::vector<double> labeling_speed;
+    if (ImGui::CollapsingHeader("Labeling benchmark")) {
+        if(colored_button("Run labeling benchmark", 0.75f)) {
+            // run length encode and label the Otsu mask of the current image like "Find components" does,
+            // with 1..max_threads threads, best of 5 runs each
+            image_t mask;
+            threshold_image_otsu(loaded_image, &mask);
+            binary_mask_t bits = pack_binary_mask(mask);
+            std::vector<int> label;
+            labeling_speed.clear();
+            for(int t = 1; t <= max_threads; ++t) {
+                set_num_threads(t);
+                double best = 1e9;
+                for(int k = 0; k < 5; ++k) {
+                    double start = time_now();
+                    run_mask_t runs = make_run_mask(bits);
+                    label_runs(runs, &label);
+                    best = std::min(best, time_now() - start);
+                }
+                labeling_speed.push_back(1e-6 * mask.w * mask.h / best);
+            }
+            set_num_threads(max_threads);
+        }
+        for(int t = 0; t < labeling_speed.size(); ++t) {
+            ImGui::Text("%2d threads: %.1f MP/s (%.2fx)", t+1, labeling_speed[t], labeling_speed[t] / labeling_speed[0]);
+        }
+    }
+
     if(colored_button("Find components", 0.25f)) {
-        cc_options_t opt = { r_g, r_b, r_n/255.f, g_r, g_b, g_n/255.f, b_r, b_g, b_n/255.f };
-        std::vector<std::pair<int,int> > points;
-        auto label = connected_components(loaded_image, opt, &points);
+        cc_options_t opt = { r_g, r_b, r_n/255.f, g_r, g_b, g_n/255.f, b_r, b_g, b_n/255.f,
+                             get_morph_op(cleanup_items[cleanup_item]), cleanup_item ? cleanup_radius : 0,
+                             use_hue_range ? CC_CLASSIFY_HUE : CC_CLASSIFY_RATIOS,
+                             hue_range[0] / 360.f, hue_range[1] / 360.f, min_saturation, min_value, min_area };
+        run_mask_t runs;
+        auto label = connected_components(loaded_image, opt, &runs, &stats);
         screen_image = copy_image(loaded_image);
-        draw_connected_components(&screen_image, label, points);
+        draw_connected_components(&screen_image, label, runs, stats, draw_boxes);
+
+        contours.clear();
+        if(find_outlines) {
+            // runs of components dropped by the area filter are emptied so they get no outline
+            run_mask_t kept = runs;
+            for(int i = 0; i < kept.runs.size(); ++i) if(label[i] < 0) kept.runs[i].x1 = kept.runs[i].x0;
+            find_contours(unpack_run_mask(kept), &contours);
+            if(simplify_epsilon > 0.f) simplify_contours(&contours, simplify_epsilon);
+        }
     }
 
     ImGui::SameLine();
 
     if(colored_button("Reset", 0.f)) {
+        contours.clear();
         screen_image = copy_image(loaded_image);
         data_format = GL_RGB;
     }
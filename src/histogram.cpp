@@ -0,0 +1,145 @@
+#include "histogram.h"
+#include "thread_pool.h"
+
+#include <cassert>
+#include <mutex>
+
+static histogram_t make_histogram(int bins, int c, float min, float max)
+{
+    histogram_t hist = { bins, c, min, max, std::vector<long long>(bins*c, 0) };
+    return hist;
+}
+
+histogram_t compute_histogram(const image_t& m, int bins, float min, float max)
+{
+    assert(bins > 0 && max > min);
+    histogram_t hist = make_histogram(bins, m.c, min, max);
+    const int n = m.w*m.h;
+    const float scale = bins / (max - min);
+    std::mutex merge_mutex;
+
+    parallel_for(n, [&](int start, int end) {
+        std::vector<long long> local(bins*m.c, 0);
+        for(int k = 0; k < m.c; ++k) {
+            const float* src = &m.data[k*n];
+            long long* counts = &local[k*bins];
+            for(int i = start; i < end; ++i) {
+                int bin = (int)((src[i] - min) * scale);
+                bin = bin < 0 ? 0 : (bin >= bins ? bins-1 : bin);
+                ++counts[bin];
+            }
+        }
+        std::lock_guard<std::mutex> lock(merge_mutex);
+        for(int i = 0; i < bins*m.c; ++i) hist.counts[i] += local[i];
+    }, 1 << 14);
+
+    return hist;
+}
+
+histogram_t compute_histogram(const unsigned char* hwc, int w, int h, int c)
+{
+    histogram_t hist = make_histogram(256, c, 0.f, 1.f);
+    std::mutex merge_mutex;
+
+    parallel_for(w*h, [&](int start, int end) {
+        std::vector<long long> local(256*c, 0);
+        for(int i = start; i < end; ++i) {
+            for(int k = 0; k < c; ++k) ++local[k*256 + hwc[i*c + k]];
+        }
+        std::lock_guard<std::mutex> lock(merge_mutex);
+        for(int i = 0; i < 256*c; ++i) hist.counts[i] += local[i];
+    }, 1 << 14);
+
+    return hist;
+}
+
+histogram_t merge_histogram_channels(const histogram_t& hist)
+{
+    histogram_t merged = make_histogram(hist.bins, 1, hist.min, hist.max);
+    for(int k = 0; k < hist.c; ++k) {
+        for(int i = 0; i < hist.bins; ++i) merged.counts[i] += hist.counts[k*hist.bins + i];
+    }
+    return merged;
+}
+
+float histogram_bin_edge(const histogram_t& hist, int i)
+{
+    return hist.min + (i + 1) * (hist.max - hist.min) / hist.bins;
+}
+
+float otsu_threshold(const histogram_t& hist, int channel)
+{
+    assert(channel < hist.c);
+    const long long* counts = &hist.counts[channel*hist.bins];
+    double total = 0, sum = 0;
+    for(int i = 0; i < hist.bins; ++i) {
+        total += counts[i];
+        sum += (double)i * counts[i];
+    }
+
+    double w0 = 0, sum0 = 0, best = -1;
+    int best_bin = 0;
+    for(int i = 0; i < hist.bins; ++i) {
+        w0 += counts[i];
+        sum0 += (double)i * counts[i];
+        double w1 = total - w0;
+        if(w0 == 0 || w1 == 0) continue;
+        double mu0 = sum0 / w0, mu1 = (sum - sum0) / w1;
+        double between = w0 * w1 * (mu0 - mu1) * (mu0 - mu1);
+        if(between > best) {
+            best = between;
+            best_bin = i;
+        }
+    }
+    return histogram_bin_edge(hist, best_bin);
+}
+
+std::vector<float> multi_otsu_thresholds(const histogram_t& hist, int num_classes, int channel)
+{
+    assert(channel < hist.c && num_classes >= 2 && num_classes <= hist.bins);
+    const int L = hist.bins, K = num_classes;
+    const long long* counts = &hist.counts[channel*L];
+
+    // prefix sums, so the weight and first moment of any run of bins is O(1)
+    std::vector<double> P(L+1, 0), S(L+1, 0);
+    for(int i = 0; i < L; ++i) {
+        P[i+1] = P[i] + counts[i];
+        S[i+1] = S[i] + (double)i * counts[i];
+    }
+    // maximizing the between-class variance is the same as maximizing the sum of s^2/w over the classes
+    auto score = [&](int a, int b) {
+        double w = P[b] - P[a], s = S[b] - S[a];
+        return w > 0 ? s*s / w : 0.0;
+    };
+
+    // best[k][j] is the best score splitting bins [0, j) into k+1 classes, split[k][j] the start of the last class
+    std::vector<std::vector<double> > best(K, std::vector<double>(L+1, -1));
+    std::vector<std::vector<int> > split(K, std::vector<int>(L+1, 0));
+    for(int j = 1; j <= L; ++j) best[0][j] = score(0, j);
+    for(int k = 1; k < K; ++k) {
+        for(int j = k+1; j <= L; ++j) {
+            for(int i = k; i < j; ++i) {
+                double val = best[k-1][i] + score(i, j);
+                if(val > best[k][j]) {
+                    best[k][j] = val;
+                    split[k][j] = i;
+                }
+            }
+        }
+    }
+
+    std::vector<float> thresholds(K-1);
+    for(int k = K-1, j = L; k > 0; --k) {
+        j = split[k][j];
+        thresholds[k-1] = histogram_bin_edge(hist, j-1);
+    }
+    return thresholds;
+}
+
+float threshold_image_otsu(const image_t& in, image_t* out)
+{
+    histogram_t hist = merge_histogram_channels(compute_histogram(in));
+    float thresh = otsu_threshold(hist);
+    threshold_image(in, out, thresh);
+    return thresh;
+}
@@ -1,5 +1,8 @@
 #include "image.h"
 
+#include <algorithm>
+#include <mutex>
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -91,6 +94,22 @@ void fill_image(image_t* m, float s)
         m->data[i] = s;
 }
 
+void rgb_to_grayscale(const image_t& in_rgb, image_t* out_gray)
+{
+    if(in_rgb.c < 3) {
+        *out_gray = make_image_grayscale(in_rgb.w, in_rgb.h);
+        std::copy(in_rgb.data.begin(), in_rgb.data.begin() + in_rgb.w*in_rgb.h, out_gray->data.begin());
+        return;
+    }
+    const int n = in_rgb.w*in_rgb.h;
+    *out_gray = make_image_grayscale(in_rgb.w, in_rgb.h);
+    const float* r = &in_rgb.data[0];
+    const float* g = &in_rgb.data[n];
+    const float* b = &in_rgb.data[2*n];
+    float* out = out_gray->data.data();
+    for(int i = 0; i < n; ++i) out[i] = 0.299f*r[i] + 0.587f*g[i] + 0.114f*b[i];
+}
+
 void threshold_image(const image_t& in_rgb, image_t* out_gray, float thresh)
 {
     *out_gray = make_image(in_rgb.w, in_rgb.h, in_rgb.c);
@@ -120,6 +139,16 @@ void threshold_image(const image_t& in_rgb, image_t* out_gray, float rt, float g
     }
 }
 
+void threshold_image(const image_t& in, image_t* out, const std::vector<float>& thresholds)
+{
+    *out = make_image(in.w, in.h, in.c);
+    const float scale = thresholds.empty() ? 0.f : 1.f / thresholds.size();
+    for(int i = 0; i < in.w*in.h*in.c; ++i) {
+        int level = 0;
+        for(float t : thresholds) level += in.data[i] > t;
+        out->data[i] = level * scale;
+    }
+}
 
 void copy_image(const image_t& src, image_t* dst)
 {
@@ -196,13 +225,21 @@ void draw_grid(image_t* m, float x_min, float x_max, float y_min, float y_max, i
 
 std::vector<unsigned char> get_hwc_bytes(const image_t& m)
 {
-    std::vector<unsigned char> bytes(m.c*m.h*m.w, 0);
+    std::vector<unsigned char> bytes;
+    get_hwc_bytes(m, &bytes);
+    return bytes;
+}
+
+void get_hwc_bytes(const image_t& m, std::vector<unsigned char>* bytes)
+{
+    bytes->resize(m.c*m.h*m.w);
+    unsigned char* out = bytes->data();
     for(int k = 0; k < m.c; ++k) {
+        const float* channel = &m.data[k*m.w*m.h];
         for(int i = 0; i < m.w*m.h; ++i) {
-            bytes[i*m.c+k] = (unsigned char) (255*m.data[i + k*m.w*m.h]);
+            out[i*m.c+k] = (unsigned char) (255*channel[i]);
         }
     }
-    return bytes;
 }
 
 image_t load_image(const char* filename, int num_channels)
@@ -229,22 +266,35 @@ image_t load_image_grayscale(const char* filename)
     return load_image(filename, 1);
 }
 
-void save_image_png(const image_t& m, const char* filename)
+// stb reads the png compression level from a global, so concurrent png writers must not interleave
+static std::mutex png_compression_mutex;
+
+bool write_png_bytes(const std::string& path, int w, int h, int c, const unsigned char* bytes, int compression_level)
+{
+    std::lock_guard<std::mutex> lock(png_compression_mutex);
+    stbi_write_png_compression_level = compression_level;
+    int success = stbi_write_png(path.c_str(), w, h, c, bytes, w*c);
+    if(!success) fprintf(stderr, "Failed to write image %s\n", path.c_str());
+    return success;
+}
+
+bool write_jpg_bytes(const std::string& path, int w, int h, int c, const unsigned char* bytes, int quality)
+{
+    int success = stbi_write_jpg(path.c_str(), w, h, c, bytes, quality);
+    if(!success) fprintf(stderr, "Failed to write image %s\n", path.c_str());
+    return success;
+}
+
+void save_image_png(const image_t& m, const char* filename, int compression_level)
 {
-    char buffer[256];
-    sprintf(buffer, "%s.png", filename);
     std::vector<unsigned char> pixels = get_hwc_bytes(m);
-    int success = stbi_write_png(buffer, m.w, m.h, m.c, pixels.data(), m.w*m.c);
-    if(!success) fprintf(stderr, "Failed to write image %s\n", buffer);
+    write_png_bytes(std::string(filename) + ".png", m.w, m.h, m.c, pixels.data(), compression_level);
 }
 
 void save_image_jpg(const image_t& m, const char* filename, int quality)
 {
-    char buffer[256];
-    sprintf(buffer, "%s.jpg", filename);
     std::vector<unsigned char> pixels = get_hwc_bytes(m);
-    int success = stbi_write_jpg(buffer, m.w, m.h, m.c, pixels.data(), quality);
-    if(!success) fprintf(stderr, "Failed to write image %s\n", buffer);
+    write_jpg_bytes(std::string(filename) + ".jpg", m.w, m.h, m.c, pixels.data(), quality);
 }
 
 void l1_normalize(image_t* im)
@@ -0,0 +1,129 @@
+#include "image_writer.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef struct {
+    std::string path;
+    image_format_t format;
+    int w, h, c;
+    int param; // compression level for png, quality for jpg
+    int buffer;
+} image_write_job_t;
+
+class image_writer_t {
+public:
+    image_writer_t() : buffers(IMAGE_WRITER_NUM_BUFFERS), num_pending(0), stop(false)
+    {
+        for(int i = 0; i < IMAGE_WRITER_NUM_BUFFERS; ++i) free_buffers.push_back(i);
+        worker = std::thread(&image_writer_t::run, this);
+    }
+
+    ~image_writer_t()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        job_ready.notify_one();
+        worker.join();
+    }
+
+    void push(const image_t& m, const std::string& path, image_format_t format, int param)
+    {
+        int buffer;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            buffer_ready.wait(lock, [this]{ return !free_buffers.empty(); });
+            buffer = free_buffers.back();
+            free_buffers.pop_back();
+            ++num_pending;
+        }
+        // the buffer is owned by this thread until the job is queued
+        get_hwc_bytes(m, &buffers[buffer]);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back({path, format, m.w, m.h, m.c, param, buffer});
+        }
+        job_ready.notify_one();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]{ return num_pending == 0; });
+    }
+
+    int pending()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_pending;
+    }
+
+private:
+    void run()
+    {
+        for(;;) {
+            image_write_job_t job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                job_ready.wait(lock, [this]{ return stop || !jobs.empty(); });
+                if(jobs.empty()) return; // only reached when stopping, queued jobs are drained first
+                job = jobs.front();
+                jobs.pop_front();
+            }
+
+            const unsigned char* bytes = buffers[job.buffer].data();
+            if(job.format == IMAGE_FORMAT_PNG) write_png_bytes(job.path, job.w, job.h, job.c, bytes, job.param);
+            else write_jpg_bytes(job.path, job.w, job.h, job.c, bytes, job.param);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_buffers.push_back(job.buffer);
+                --num_pending;
+            }
+            buffer_ready.notify_one();
+            idle.notify_all();
+        }
+    }
+
+    std::vector<std::vector<unsigned char> > buffers;
+    std::vector<int> free_buffers;
+    std::deque<image_write_job_t> jobs;
+    int num_pending;
+    bool stop;
+
+    std::mutex mutex;
+    std::condition_variable job_ready, buffer_ready, idle;
+    std::thread worker;
+};
+
+static image_writer_t& get_image_writer()
+{
+    // started on first use and joined at exit after all queued images are written
+    static image_writer_t writer;
+    return writer;
+}
+
+void save_image_png_async(const image_t& m, const std::string& filename, int compression_level)
+{
+    get_image_writer().push(m, filename + ".png", IMAGE_FORMAT_PNG, compression_level);
+}
+
+void save_image_jpg_async(const image_t& m, const std::string& filename, int quality)
+{
+    get_image_writer().push(m, filename + ".jpg", IMAGE_FORMAT_JPG, quality);
+}
+
+void wait_image_writes()
+{
+    get_image_writer().wait();
+}
+
+int num_pending_image_writes()
+{
+    return get_image_writer().pending();
+}
@@ -0,0 +1,122 @@
+#include "integral_image.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static void build_table(const image_t& m, bool squared, std::vector<double>* table)
+{
+    const int w = m.w, h = m.h, stride = w + 1, plane = (w+1)*(h+1);
+    table->assign(plane*m.c, 0.0);
+
+    // scan 1: inclusive prefix sums along each row, rows are independent
+    parallel_for(h*m.c, [&](int start, int end) {
+        for(int row = start; row < end; ++row) {
+            const int k = row / h, y = row % h;
+            const float* src = &m.data[k*w*h + y*w];
+            double* dst = &(*table)[k*plane + (y+1)*stride + 1];
+            double acc = 0.0;
+            for(int x = 0; x < w; ++x) {
+                acc += squared ? (double)src[x]*src[x] : (double)src[x];
+                dst[x] = acc;
+            }
+        }
+    }, 16);
+
+    // scan 2: running sums down the columns, every thread owns a range of columns and adds whole
+    // row segments so the inner loop stays contiguous
+    for(int k = 0; k < m.c; ++k) {
+        double* base = &(*table)[k*plane];
+        parallel_for(w, [&](int start, int end) {
+            for(int y = 2; y <= h; ++y) {
+                const double* prev = &base[(y-1)*stride + 1];
+                double* cur = &base[y*stride + 1];
+                for(int x = start; x < end; ++x) cur[x] += prev[x];
+            }
+        }, 256);
+    }
+}
+
+integral_image_t make_integral_image(const image_t& m, bool squared)
+{
+    integral_image_t ii;
+    ii.w = m.w;
+    ii.h = m.h;
+    ii.c = m.c;
+    build_table(m, false, &ii.sum);
+    if(squared) build_table(m, true, &ii.sq_sum);
+    return ii;
+}
+
+static double rect_sum(const std::vector<double>& table, int w, int h, int x0, int y0, int x1, int y1, int c)
+{
+    x0 = std::max(x0, 0); y0 = std::max(y0, 0);
+    x1 = std::min(x1, w-1); y1 = std::min(y1, h-1);
+    if(x0 > x1 || y0 > y1) return 0.0;
+    const int stride = w + 1;
+    const double* t = &table[c*(w+1)*(h+1)];
+    return t[(y1+1)*stride + x1+1] - t[y0*stride + x1+1] - t[(y1+1)*stride + x0] + t[y0*stride + x0];
+}
+
+double integral_sum(const integral_image_t& ii, int x0, int y0, int x1, int y1, int c)
+{
+    return rect_sum(ii.sum, ii.w, ii.h, x0, y0, x1, y1, c);
+}
+
+double integral_sq_sum(const integral_image_t& ii, int x0, int y0, int x1, int y1, int c)
+{
+    return rect_sum(ii.sq_sum, ii.w, ii.h, x0, y0, x1, y1, c);
+}
+
+adaptive_threshold_type_t get_adaptive_threshold_type(const char* s)
+{
+    if(strcmp(s, "bradley") == 0) return ADAPTIVE_BRADLEY;
+    if(strcmp(s, "sauvola") == 0) return ADAPTIVE_SAUVOLA;
+    return ADAPTIVE_BRADLEY;
+}
+
+void adaptive_threshold_bradley(const image_t& in, image_t* out, int radius, float t)
+{
+    image_t gray;
+    rgb_to_grayscale(in, &gray);
+    integral_image_t ii = make_integral_image(gray);
+    const int w = gray.w, h = gray.h;
+    *out = make_image_grayscale(w, h);
+
+    parallel_for(h, [&](int start, int end) {
+        for(int y = start; y < end; ++y) {
+            const int y0 = std::max(y - radius, 0), y1 = std::min(y + radius, h-1);
+            for(int x = 0; x < w; ++x) {
+                const int x0 = std::max(x - radius, 0), x1 = std::min(x + radius, w-1);
+                const double area = (double)(x1 - x0 + 1) * (y1 - y0 + 1);
+                const double sum = integral_sum(ii, x0, y0, x1, y1);
+                out->data[y*w + x] = gray.data[y*w + x]*area > sum*(1.0 - t) ? 1.f : 0.f;
+            }
+        }
+    }, 16);
+}
+
+void adaptive_threshold_sauvola(const image_t& in, image_t* out, int radius, float k, float r)
+{
+    image_t gray;
+    rgb_to_grayscale(in, &gray);
+    integral_image_t ii = make_integral_image(gray, true);
+    const int w = gray.w, h = gray.h;
+    *out = make_image_grayscale(w, h);
+
+    parallel_for(h, [&](int start, int end) {
+        for(int y = start; y < end; ++y) {
+            const int y0 = std::max(y - radius, 0), y1 = std::min(y + radius, h-1);
+            for(int x = 0; x < w; ++x) {
+                const int x0 = std::max(x - radius, 0), x1 = std::min(x + radius, w-1);
+                const double area = (double)(x1 - x0 + 1) * (y1 - y0 + 1);
+                const double mean = integral_sum(ii, x0, y0, x1, y1) / area;
+                const double var = integral_sq_sum(ii, x0, y0, x1, y1) / area - mean*mean;
+                const double stddev = sqrt(std::max(var, 0.0));
+                const double thresh = mean * (1.0 + k * (stddev / r - 1.0));
+                out->data[y*w + x] = gray.data[y*w + x] > thresh ? 1.f : 0.f;
+            }
+        }
+    }, 16);
+}
@@ -0,0 +1,87 @@
+#include "kd_tree.h"
+
+#include <algorithm>
+#include <cassert>
+
+static int build_node(const matrix_t& data, int start, int end, kd_tree_t* tree)
+{
+    const int d = tree->d;
+    const int node = tree->nodes.size();
+    tree->nodes.push_back({start, end, -1, -1});
+    tree->lo.resize((node + 1)*d);
+    tree->hi.resize((node + 1)*d);
+    tree->sum.resize((node + 1)*d, 0.0);
+
+    int* index = tree->index.data();
+    for(int j = 0; j < d; ++j) {
+        float lo = data.vals[index[start]][j], hi = lo;
+        for(int i = start + 1; i < end; ++i) {
+            lo = std::min(lo, data.vals[index[i]][j]);
+            hi = std::max(hi, data.vals[index[i]][j]);
+        }
+        tree->lo[node*d + j] = lo;
+        tree->hi[node*d + j] = hi;
+    }
+
+    int split = 0;
+    for(int j = 1; j < d; ++j) {
+        if(tree->hi[node*d + j] - tree->lo[node*d + j] > tree->hi[node*d + split] - tree->lo[node*d + split]) split = j;
+    }
+    // a box of identical points cannot be split any further
+    if(end - start <= tree->leaf_size || tree->hi[node*d + split] == tree->lo[node*d + split]) {
+        for(int i = start; i < end; ++i) {
+            for(int j = 0; j < d; ++j) tree->sum[node*d + j] += data.vals[index[i]][j];
+        }
+        return node;
+    }
+
+    const int mid = (start + end) / 2;
+    std::nth_element(index + start, index + mid, index + end, [&](int a, int b) {
+        return data.vals[a][split] < data.vals[b][split];
+    });
+    // nodes grows while the children are built, so the parent is looked up by index afterwards
+    const int left = build_node(data, start, mid, tree);
+    const int right = build_node(data, mid, end, tree);
+    tree->nodes[node].left = left;
+    tree->nodes[node].right = right;
+    for(int j = 0; j < d; ++j) tree->sum[node*d + j] = tree->sum[left*d + j] + tree->sum[right*d + j];
+    return node;
+}
+
+kd_tree_t make_kd_tree(const matrix_t& data, int leaf_size)
+{
+    assert(leaf_size > 0);
+    kd_tree_t tree;
+    tree.n = data.rows;
+    tree.d = data.cols;
+    tree.leaf_size = leaf_size;
+    tree.index.resize(data.rows);
+    for(int i = 0; i < data.rows; ++i) tree.index[i] = i;
+    if(data.rows == 0) return tree;
+
+    build_node(data, 0, data.rows, &tree);
+    tree.points.resize((size_t)tree.n*tree.d);
+    for(int i = 0; i < tree.n; ++i) {
+        std::copy(data.vals[tree.index[i]].begin(), data.vals[tree.index[i]].end(), &tree.points[(size_t)i*tree.d]);
+    }
+    return tree;
+}
+
+std::vector<int> kd_tree_frontier(const kd_tree_t& tree, int depth)
+{
+    std::vector<int> level;
+    if(tree.nodes.empty()) return level;
+    level.push_back(0);
+    for(int i = 0; i < depth; ++i) {
+        std::vector<int> next;
+        for(int node : level) {
+            if(tree.nodes[node].left < 0) next.push_back(node);
+            else {
+                next.push_back(tree.nodes[node].left);
+                next.push_back(tree.nodes[node].right);
+            }
+        }
+        level.swap(next);
+    }
+    return level;
+}
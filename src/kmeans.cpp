@@ -1,12 +1,21 @@
 #include "kmeans.h"
+#include "distance_kernels.h"
+#include "kd_tree.h"
 #include "rng.h"
+#include "thread_pool.h"
 
 #include <cassert>
 #include <array>
+#include <atomic>
 #include <cstdio>
 #include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <random>
 
-void random_centers(const matrix_t& data, matrix_t* centers)
+void random_centers(const matrix_t& data, matrix_t* centers, std::mt19937* gen)
 {
     assert(centers->cols == data.cols);
 
@@ -15,46 +24,159 @@ void random_centers(const matrix_t& data, matrix_t* centers)
     for(int i = 0; i < index_array.size(); ++i) {
         index_array[i] = i;
     }
-    std::random_shuffle(index_array.begin(), index_array.end());
+    if(gen) std::shuffle(index_array.begin(), index_array.end(), *gen);
+    else std::random_shuffle(index_array.begin(), index_array.end());
 
     for(int i = 0; i < centers->rows; ++i) {
         centers->vals[i] = data.vals[index_array[i]];
     }
 }
 
-void smart_centers(const matrix_t& data, matrix_t* centers, kmeans_metric_t metric)
+// lowers closest[i] to the cost of point i against the centers in [from, to), and owner[i] to that center.
+// The cost is the distance as in kmeans_cost, squared for L2, which center_distances already leaves it
+static void update_closest(const matrix_t& data, const matrix_t& centers, int from, int to, kmeans_metric_t metric,
+                           std::vector<float>* closest, std::vector<int>* owner)
+{
+    const center_block_t block = make_center_block(centers, from, to);
+    parallel_for(data.rows, [&](int start, int end) {
+        std::vector<float> value(block.stride);
+        for(int i = start; i < end; ++i) {
+            center_distances(data.vals[i].data(), block, metric, value.data());
+            int best = 0;
+            for(int j = 1; j < block.k; ++j) if(value[j] < value[best]) best = j;
+            if(value[best] < (*closest)[i]) {
+                (*closest)[i] = value[best];
+                if(owner) (*owner)[i] = from + best;
+            }
+        }
+    }, 256);
+}
+
+// index j with probability weight[j] * closest[j] / total, total being the sum of those products
+static int sample_index(const std::vector<float>& closest, const std::vector<float>* weights, double total, float u)
+{
+    const int n = closest.size();
+    double r = total * u;
+    int last = n - 1;
+    for(int j = 0; j < n; ++j) {
+        const double p = weights ? (double)(*weights)[j]*closest[j] : closest[j];
+        if(p <= 0) continue;
+        last = j;
+        r -= p;
+        if(r <= 0) return j;
+    }
+    // rounding can leave a little of r, the last point that could be picked takes it
+    return last;
+}
+
+void smart_centers(const matrix_t& data, matrix_t* centers, kmeans_metric_t metric, const std::vector<float>* weights,
+                   std::mt19937* gen)
 {
     assert(data.cols == centers->cols);
+    assert(data.rows > 0);
+    if(centers->rows == 0) return;
 
-    RNG rng(0, data.rows);
-    centers->vals[0] = data.vals[rng.getInt()];
+    std::vector<float> closest(data.rows, 1.f);
+    double total = data.rows;
+    if(weights) {
+        total = 0;
+        for(int j = 0; j < data.rows; ++j) total += (*weights)[j];
+    }
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    auto next_float = [&]() { return gen ? uniform(*gen) : rng0.getFloat(); };
+    int first;
+    if(weights) first = sample_index(closest, weights, total, next_float());
+    else if(gen) first = std::uniform_int_distribution<int>(0, data.rows - 1)(*gen);
+    else {
+        RNG rng(0, data.rows - 1);
+        first = rng.getInt();
+    }
+    centers->vals[0] = data.vals[first];
 
-    std::vector<float> closest_dist_to_centroid(data.rows, 0.f);
-    int num_centers = centers->rows;
-    for (int i = 1; i < num_centers; ++i) {
-        float sum = 0;
-        centers->rows = i;
-        for (int j = 0; j < data.rows; ++j) {
-            closest_dist_to_centroid[j] = get_closest_center(data.vals[j], *centers, metric).second;
-            sum += closest_dist_to_centroid[j];
-        }
-        float r = sum * rng0.getFloat();
-        for (int j = 0; j < data.rows; ++j) {
-            r -= closest_dist_to_centroid[j];
-            if(r <= 0) {
-                centers->vals[i] = data.vals[j];
-                break;
+    // cost of every point against the centers picked so far, only the newest center has to be measured
+    std::fill(closest.begin(), closest.end(), std::numeric_limits<float>::max());
+    update_closest(data, *centers, 0, 1, metric, &closest, NULL);
+    for (int i = 1; i < centers->rows; ++i) {
+        total = 0;
+        for (int j = 0; j < data.rows; ++j) total += weights ? (double)(*weights)[j]*closest[j] : closest[j];
+        centers->vals[i] = data.vals[sample_index(closest, weights, total, next_float())];
+        update_closest(data, *centers, i, i + 1, metric, &closest, NULL);
+    }
+}
+
+void scalable_centers(const matrix_t& data, matrix_t* centers, kmeans_metric_t metric, int rounds, float oversampling,
+                      std::mt19937* gen)
+{
+    assert(data.cols == centers->cols);
+    assert(data.rows > 0);
+    const int n = data.rows, k = centers->rows;
+    if(k == 0) return;
+    if(oversampling <= 0) oversampling = 2.f*k;
+
+    std::mt19937 own_gen;
+    if(!gen) {
+        own_gen.seed(std::random_device{}());
+        gen = &own_gen;
+    }
+    const unsigned int seed = (*gen)();
+    matrix_t candidates = make_matrix(0, data.cols);
+    candidates.vals.push_back(data.vals[std::uniform_int_distribution<int>(0, n - 1)(*gen)]);
+    candidates.rows = 1;
+
+    std::vector<float> closest(n, std::numeric_limits<float>::max());
+    std::vector<int> owner(n, 0);
+    update_closest(data, candidates, 0, 1, metric, &closest, &owner);
+
+    // points are sampled independently, each block of points with its own generator so the
+    // candidates do not depend on how the blocks are spread over the threads
+    const int block = 4096;
+    const int num_blocks = (n + block - 1) / block;
+    std::vector<std::vector<int> > picked(num_blocks);
+    for(int round = 0; round < rounds; ++round) {
+        double cost = 0;
+        for(int i = 0; i < n; ++i) cost += closest[i];
+        if(cost <= 0) break;
+
+        parallel_for(num_blocks, [&](int start, int end) {
+            for(int b = start; b < end; ++b) {
+                std::mt19937 block_gen(seed + 7919u*(unsigned int)(round*num_blocks + b));
+                std::uniform_real_distribution<double> u(0.0, 1.0);
+                picked[b].clear();
+                for(int i = b*block; i < std::min(n, (b+1)*block); ++i) {
+                    if(u(block_gen) < oversampling*closest[i]/cost) picked[b].push_back(i);
+                }
             }
+        });
+
+        const int from = candidates.rows;
+        for(int b = 0; b < num_blocks; ++b) {
+            for(int i : picked[b]) candidates.vals.push_back(data.vals[i]);
+        }
+        candidates.rows = candidates.vals.size();
+        update_closest(data, candidates, from, candidates.rows, metric, &closest, &owner);
+    }
+
+    if(candidates.rows <= k) {
+        // too few distinct points were found, the rest of the centers are drawn at random
+        for(int i = 0; i < k; ++i) {
+            centers->vals[i] = i < candidates.rows ? candidates.vals[i]
+                                                   : data.vals[std::uniform_int_distribution<int>(0, n - 1)(*gen)];
         }
+        return;
     }
-    centers->rows = num_centers;
+
+    // every candidate stands for the points closest to it
+    std::vector<float> weights(candidates.rows, 0.f);
+    for(int i = 0; i < n; ++i) weights[owner[i]] += 1.f;
+    smart_centers(candidates, centers, metric, &weights, gen);
 }
 
-float dist(std::vector<float> x, std::vector<float> y, kmeans_metric_t metric)
+float dist(const std::vector<float>& x, const std::vector<float>& y, kmeans_metric_t metric)
 {
     assert(x.size() == y.size());
     const int n = x.size();
 
+    // same operations in the same order as the kernels in distance_kernels.cpp
     float dist = 0;
     switch (metric)
     {
@@ -62,18 +184,18 @@ float dist(std::vector<float> x, std::vector<float> y, kmeans_metric_t metric)
             // assumes that first index is box width and second index is box height
             float min_w = std::min(x[0], y[0]), min_h = std::min(x[1], y[1]);
             float box_intersect = min_w * min_h;
-            float box_union = (x[0] * x[1] + y[0] * y[1]) - box_intersect;
+            float box_union = madd(-min_w, min_h, madd(y[0], y[1], x[0] * x[1]));
             float iou = box_intersect / box_union;
             dist = 1 - iou;
             break;
         }
         case L1: {
-            for(int i = 0; i < n; ++i) dist += fabs(x[i]-y[i]);
+            for(int i = 0; i < n; ++i) dist += fabsf(x[i]-y[i]);
             break;
         }
         case L2: {
-            for(int i = 0; i < n; ++i) dist += (x[i]-y[i])*(x[i]-y[i]);
-            dist = sqrt(dist);
+            for(int i = 0; i < n; ++i) dist = madd(x[i]-y[i], x[i]-y[i], dist);
+            dist = sqrtf(dist);
             break;
         }
     }
@@ -85,7 +207,7 @@ std::pair<int, float> get_closest_center(const std::vector<float>& data, const m
 {
     int closest_center = 0;
     float closest_dist = dist(data, centers.vals[closest_center], metric);
-    for(int i = 0; i < centers.rows; ++i) {
+    for(int i = 1; i < centers.rows; ++i) {
         float cur_dist = dist(data, centers.vals[i], metric);
         if(cur_dist < closest_dist) {
             closest_dist = cur_dist;
@@ -95,38 +217,643 @@ std::pair<int, float> get_closest_center(const std::vector<float>& data, const m
     return std::make_pair(closest_center, closest_dist);
 }
 
-bool kmeans_expectation(matrix_t data, model_t* model, kmeans_metric_t metric)
+bool kmeans_expectation(const matrix_t& data, model_t* model, kmeans_metric_t metric)
 {
-    bool converged = true;
-    for(int i = 0; i < data.rows; ++i) {
-        auto closest = get_closest_center(data.vals[i], model->centers, metric);
-        int closest_center_idx = closest.first;
-        if(closest_center_idx != model->assignments[i]) converged = false;
-        model->assignments[i] = closest_center_idx;
+    std::atomic<bool> converged(true);
+    const center_block_t centers = make_center_block(model->centers);
+    parallel_for(data.rows, [&](int start, int end) {
+        std::vector<int> closest(end - start);
+        closest_centers(data, start, end, centers, metric, closest.data(), NULL);
+        bool changed = false;
+        for(int i = start; i < end; ++i) {
+            if(closest[i - start] != model->assignments[i]) changed = true;
+            model->assignments[i] = closest[i - start];
+        }
+        if(changed) converged = false;
+    }, 256);
+    return converged;
+}
+
+void kmeans_maximization(const matrix_t& data, model_t* model, const std::vector<float>* weights)
+{
+    const int k = model->centers.rows, d = model->centers.cols, n = data.rows;
+    // Partial sums over fixed blocks of points that depend only on n, added up in a fixed pairwise tree.
+    // The threads only decide who computes which block, so the centers are the same for any thread count
+    const int block = std::max(4096, (n + 255) / 256);
+    const int num_blocks = std::max(1, (n + block - 1) / block);
+    std::vector<std::vector<double> > sums(num_blocks);
+    std::vector<std::vector<double> > counts(num_blocks);
+
+    parallel_for(num_blocks, [&](int start, int end) {
+        for(int b = start; b < end; ++b) {
+            sums[b].assign(k*d, 0.0);
+            counts[b].assign(k, 0.0);
+            for(int i = b*block; i < std::min(n, (b+1)*block); ++i) {
+                const int c = model->assignments[i];
+                const double w = weights ? (*weights)[i] : 1.0;
+                counts[b][c] += w;
+                double* sum = &sums[b][c*d];
+                for(int j = 0; j < d; ++j) sum[j] += w*data.vals[i][j];
+            }
+        }
+    }, 1);
+
+    for(int stride = 1; stride < num_blocks; stride *= 2) {
+        parallel_for((num_blocks + 2*stride - 1) / (2*stride), [&](int start, int end) {
+            for(int p = start; p < end; ++p) {
+                const int b = 2*stride*p;
+                if(b + stride >= num_blocks) continue;
+                for(int j = 0; j < k*d; ++j) sums[b][j] += sums[b + stride][j];
+                for(int c = 0; c < k; ++c) counts[b][c] += counts[b + stride][c];
+            }
+        }, 1);
+    }
+
+    // empty clusters end up at the origin
+    for(int c = 0; c < k; ++c) {
+        for(int j = 0; j < d; ++j) {
+            model->centers.vals[c][j] = counts[0][c] ? (float)(sums[0][c*d + j] / counts[0][c]) : 0.f;
+        }
+    }
+}
+
+kmeans_algorithm_t get_kmeans_algorithm(const char* s)
+{
+    if(strcmp(s, "lloyd") == 0) return KMEANS_LLOYD;
+    if(strcmp(s, "elkan") == 0) return KMEANS_ELKAN;
+    if(strcmp(s, "hamerly") == 0) return KMEANS_HAMERLY;
+    if(strcmp(s, "yinyang") == 0) return KMEANS_YINYANG;
+    if(strcmp(s, "filter") == 0) return KMEANS_FILTER;
+    if(strcmp(s, "auto") == 0) return KMEANS_AUTO;
+    return KMEANS_LLOYD;
+}
+
+kmeans_algorithm_t choose_kmeans_algorithm(int n, int k, int d)
+{
+    // with a handful of centers the bookkeeping costs about as much as the distances it saves
+    if(k < 4) return KMEANS_LLOYD;
+    // low dimensional boxes stay tight, so whole tree nodes go to a single center
+    if(d <= 8 && n >= 10000) return KMEANS_FILTER;
+    // hundreds of centers, or too many points for k bounds each: per group bounds prune almost as well
+    if(k >= 64 || (long long)n*k > 50000000) return KMEANS_YINYANG;
+    // few centers in low dimensions, a single bound is enough and keeps the memory at two floats per point
+    if(d <= 16 && k < 16) return KMEANS_HAMERLY;
+    return KMEANS_ELKAN;
+}
+
+// how far every center moved since the bounds were last valid
+static void center_drift(const matrix_t& prev_centers, const matrix_t& centers, kmeans_metric_t metric, std::vector<float>* drift)
+{
+    drift->resize(centers.rows);
+    for(int j = 0; j < centers.rows; ++j) (*drift)[j] = dist(prev_centers.vals[j], centers.vals[j], metric);
+}
+
+// half the distance from every center to its nearest other center
+static void half_min_center_dist(const matrix_t& centers, kmeans_metric_t metric, std::vector<float>* half_min, std::vector<float>* center_dist = NULL)
+{
+    const int k = centers.rows;
+    half_min->assign(k, 1e30f);
+    if(center_dist) center_dist->assign(k*k, 0.f);
+    for(int j = 0; j < k; ++j) {
+        for(int l = j+1; l < k; ++l) {
+            const float d = dist(centers.vals[j], centers.vals[l], metric);
+            if(center_dist) (*center_dist)[j*k + l] = (*center_dist)[l*k + j] = d;
+            (*half_min)[j] = std::min((*half_min)[j], 0.5f*d);
+            (*half_min)[l] = std::min((*half_min)[l], 0.5f*d);
+        }
+    }
+}
+
+// distances from x to every center of the block, written to out[0..k). Same values as dist(), but with the
+// kernels of distance_kernels.h
+static inline void all_distances(const std::vector<float>& x, const center_block_t& block, kmeans_metric_t metric, float* out)
+{
+    center_distances(x.data(), block, metric, out);
+    if(metric == L2) for(int j = 0; j < block.k; ++j) out[j] = sqrtf(out[j]);
+}
+
+// bounds carried between the iterations of elkan's algorithm, valid for prev_centers
+typedef struct {
+    matrix_t prev_centers;
+    std::vector<float> upper;  // upper bound on the distance of every point to its center
+    std::vector<float> lower;  // rows x k lower bounds on the distance of every point to every center
+} elkan_state_t;
+
+// Same assignments as kmeans_expectation up to the rounding described in kmeans.h. A center is only skipped if
+// it is strictly further away than the assigned one, so ties are still evaluated and resolved to the lowest
+// index like get_closest_center
+static bool kmeans_expectation_elkan(const matrix_t& data, model_t* model, kmeans_metric_t metric,
+                                     elkan_state_t* state, long long* evaluations)
+{
+    const int n = data.rows, k = model->centers.rows;
+    const matrix_t& centers = model->centers;
+    std::vector<int>& assignments = model->assignments;
+    std::atomic<bool> converged(true);
+
+    if(state->upper.empty()) {
+        state->upper.resize(n);
+        state->lower.resize(n*k);
+        const center_block_t block = make_center_block(centers);
+        parallel_for(n, [&](int start, int end) {
+            bool changed = false;
+            for(int i = start; i < end; ++i) {
+                float* lower = &state->lower[i*k];
+                all_distances(data.vals[i], block, metric, lower);
+                int best = 0;
+                for(int j = 1; j < k; ++j) if(lower[j] < lower[best]) best = j;
+                if(best != assignments[i]) changed = true;
+                assignments[i] = best;
+                state->upper[i] = lower[best];
+            }
+            if(changed) converged = false;
+        }, 256);
+        *evaluations += (long long)n*k;
+        state->prev_centers = centers;
+        return converged;
     }
+
+    std::vector<float> drift, center_dist, half_min;
+    center_drift(state->prev_centers, centers, metric, &drift);
+    half_min_center_dist(centers, metric, &half_min, &center_dist);
+    *evaluations += k + (long long)k*(k-1)/2;
+
+    std::atomic<long long> evals(0);
+    parallel_for(n, [&](int start, int end) {
+        long long count = 0;
+        bool changed = false;
+        for(int i = start; i < end; ++i) {
+            float* lower = &state->lower[i*k];
+            for(int j = 0; j < k; ++j) lower[j] = std::max(0.f, lower[j] - drift[j]);
+            int a = assignments[i];
+            float u = state->upper[i] + drift[a];
+            bool tight = false;
+
+            if(u < half_min[a]) {
+                state->upper[i] = u;
+                continue;
+            }
+            for(int j = 0; j < k; ++j) {
+                if(j == a || (u < lower[j] && u < 0.5f*center_dist[a*k + j])) continue;
+                if(!tight) {
+                    u = lower[a] = dist(data.vals[i], centers.vals[a], metric);
+                    count++;
+                    tight = true;
+                    if(u < lower[j] && u < 0.5f*center_dist[a*k + j]) continue;
+                }
+                const float d = lower[j] = dist(data.vals[i], centers.vals[j], metric);
+                count++;
+                if(d < u || (d == u && j < a)) {
+                    a = j;
+                    u = d;
+                }
+            }
+            if(a != assignments[i]) changed = true;
+            assignments[i] = a;
+            state->upper[i] = u;
+        }
+        evals += count;
+        if(changed) converged = false;
+    }, 256);
+    *evaluations += evals;
+    state->prev_centers = centers;
     return converged;
 }
 
-void kmeans_maximization(matrix_t data, model_t* model)
+// bounds for hamerly's algorithm, valid for prev_centers
+typedef struct {
+    matrix_t prev_centers;
+    std::vector<float> upper;  // upper bound on the distance of every point to its center
+    std::vector<float> lower;  // lower bound on the distance of every point to all other centers
+} hamerly_state_t;
+
+// distances from x to all centers, returns the closest one with ties to the lowest index like
+// get_closest_center and stores the distance to the second closest in second. value is scratch for k floats
+static int closest_two(const std::vector<float>& x, const center_block_t& block, kmeans_metric_t metric, float* value,
+                       float* best_dist, float* second)
 {
-    std::vector<int> counts(model->centers.rows, 0);
-    zero_matrix(&model->centers);
-    for(int i = 0; i < data.rows; ++i) {
-        counts[model->assignments[i]]++;
-        for(int j = 0; j < data.cols; ++j){
-            model->centers.vals[model->assignments[i]][j] += data.vals[i][j];
+    int best = 0;
+    *best_dist = *second = 1e30f;
+    all_distances(x, block, metric, value);
+    for(int j = 0; j < block.k; ++j) {
+        const float d = value[j];
+        if(d < *best_dist) {
+            *second = *best_dist;
+            *best_dist = d;
+            best = j;
+        }
+        else if(d < *second) *second = d;
+    }
+    return best;
+}
+
+static bool kmeans_expectation_hamerly(const matrix_t& data, model_t* model, kmeans_metric_t metric,
+                                       hamerly_state_t* state, long long* evaluations)
+{
+    const int n = data.rows, k = model->centers.rows;
+    const matrix_t& centers = model->centers;
+    std::vector<int>& assignments = model->assignments;
+    std::atomic<bool> converged(true);
+
+    std::vector<float> drift(k, 0.f), half_min;
+    const bool first = state->upper.empty();
+    if(first) {
+        state->upper.resize(n);
+        state->lower.resize(n);
+    }
+    else {
+        center_drift(state->prev_centers, centers, metric, &drift);
+        half_min_center_dist(centers, metric, &half_min);
+        *evaluations += k + (long long)k*(k-1)/2;
+    }
+
+    // the lower bound drops by the largest drift of any other center
+    int max_moved = 0;
+    for(int j = 1; j < k; ++j) if(drift[j] > drift[max_moved]) max_moved = j;
+    float second_drift = 0.f;
+    for(int j = 0; j < k; ++j) if(j != max_moved) second_drift = std::max(second_drift, drift[j]);
+
+    const center_block_t block = make_center_block(centers);
+    std::atomic<long long> evals(0);
+    parallel_for(n, [&](int start, int end) {
+        std::vector<float> value(block.stride);
+        long long count = 0;
+        bool changed = false;
+        for(int i = start; i < end; ++i) {
+            int a = assignments[i];
+            if(!first) {
+                float u = state->upper[i] + drift[a];
+                const float l = state->lower[i] - (a == max_moved ? second_drift : drift[max_moved]);
+                // skip only if every other center is strictly further, so ties still go to the lowest index
+                if(u < std::max(half_min[a], l)) {
+                    state->upper[i] = u;
+                    state->lower[i] = l;
+                    continue;
+                }
+                u = dist(data.vals[i], centers.vals[a], metric);
+                count++;
+                if(u < std::max(half_min[a], l)) {
+                    state->upper[i] = u;
+                    state->lower[i] = l;
+                    continue;
+                }
+            }
+            a = closest_two(data.vals[i], block, metric, value.data(), &state->upper[i], &state->lower[i]);
+            count += k;
+            if(a != assignments[i]) changed = true;
+            assignments[i] = a;
         }
+        evals += count;
+        if(changed) converged = false;
+    }, 256);
+    *evaluations += evals;
+    state->prev_centers = centers;
+    return converged;
+}
+
+// bounds for yinyang k-means, valid for prev_centers
+typedef struct {
+    matrix_t prev_centers;
+    int num_groups;
+    std::vector<int> group;                 // group of every center
+    std::vector<std::vector<int> > members; // centers of every group
+    std::vector<float> upper;               // upper bound on the distance of every point to its center
+    std::vector<float> lower;               // rows x num_groups lower bounds on the distance to the other centers of each group
+} yinyang_state_t;
+
+// groups the initial centers with a few rounds of lloyd on the centers themselves, nearby centers
+// in one group give tighter group bounds
+static void group_centers(const matrix_t& centers, kmeans_metric_t metric, yinyang_state_t* state)
+{
+    const int k = centers.rows, t = std::max(1, k / 10);
+    matrix_t group_centers = make_matrix(t, centers.cols);
+    for(int g = 0; g < t; ++g) group_centers.vals[g] = centers.vals[g*k/t];
+    model_t groups = {std::vector<int>(k, 0), group_centers};
+    for(int iter = 0; iter < 5; ++iter) {
+        if(kmeans_expectation(centers, &groups, metric)) break;
+        kmeans_maximization(centers, &groups);
     }
-    for(int i = 0; i < model->centers.rows; ++i) { 
-        if(counts[i]) {
-            for(int j = 0; j < model->centers.cols; ++j) {
-                model->centers.vals[i][j] /= counts[i];
+
+    state->num_groups = t;
+    state->group = groups.assignments;
+    state->members.assign(t, std::vector<int>());
+    for(int j = 0; j < k; ++j) state->members[state->group[j]].push_back(j);
+}
+
+static bool kmeans_expectation_yinyang(const matrix_t& data, model_t* model, kmeans_metric_t metric,
+                                       yinyang_state_t* state, long long* evaluations)
+{
+    const int n = data.rows, k = model->centers.rows;
+    const matrix_t& centers = model->centers;
+    std::vector<int>& assignments = model->assignments;
+    std::atomic<bool> converged(true);
+
+    if(state->upper.empty()) {
+        group_centers(centers, metric, state);
+        const int t = state->num_groups;
+        state->upper.resize(n);
+        state->lower.assign(n*t, 1e30f);
+        const center_block_t block = make_center_block(centers);
+        parallel_for(n, [&](int start, int end) {
+            std::vector<float> value(block.stride);
+            bool changed = false;
+            for(int i = start; i < end; ++i) {
+                all_distances(data.vals[i], block, metric, value.data());
+                int best = 0;
+                for(int j = 1; j < k; ++j) if(value[j] < value[best]) best = j;
+                float* lower = &state->lower[i*t];
+                for(int j = 0; j < k; ++j) if(j != best) lower[state->group[j]] = std::min(lower[state->group[j]], value[j]);
+                if(best != assignments[i]) changed = true;
+                assignments[i] = best;
+                state->upper[i] = value[best];
             }
+            if(changed) converged = false;
+        }, 256);
+        *evaluations += (long long)n*k;
+        state->prev_centers = centers;
+        return converged;
+    }
+
+    const int t = state->num_groups;
+    std::vector<float> drift, group_drift(t, 0.f);
+    center_drift(state->prev_centers, centers, metric, &drift);
+    *evaluations += k;
+    for(int j = 0; j < k; ++j) group_drift[state->group[j]] = std::max(group_drift[state->group[j]], drift[j]);
+
+    std::atomic<long long> evals(0);
+    parallel_for(n, [&](int start, int end) {
+        std::vector<float> value(k), prev_lower(t);
+        std::vector<char> visited(t);
+        long long count = 0;
+        bool changed = false;
+        for(int i = start; i < end; ++i) {
+            float* lower = &state->lower[i*t];
+            const int a0 = assignments[i];
+            float u = state->upper[i] + drift[a0];
+            float global_lower = 1e30f;
+            for(int g = 0; g < t; ++g) {
+                prev_lower[g] = lower[g];
+                lower[g] = std::max(0.f, lower[g] - group_drift[g]);
+                global_lower = std::min(global_lower, lower[g]);
+            }
+
+            // global filter, strict so that ties are always evaluated
+            if(u < global_lower) {
+                state->upper[i] = u;
+                continue;
+            }
+            u = dist(data.vals[i], centers.vals[a0], metric);
+            count++;
+            if(u < global_lower) {
+                state->upper[i] = u;
+                continue;
+            }
+
+            // group filter, then a local filter per center with its own drift
+            int best = a0;
+            float best_dist = u;
+            for(int g = 0; g < t; ++g) {
+                visited[g] = lower[g] <= best_dist;
+                if(!visited[g]) continue;
+                for(int j : state->members[g]) {
+                    if(j == a0) {
+                        value[j] = u;
+                        continue;
+                    }
+                    const float bound = prev_lower[g] - drift[j];
+                    if(bound > best_dist) {
+                        value[j] = bound;
+                        continue;
+                    }
+                    value[j] = dist(data.vals[i], centers.vals[j], metric);
+                    count++;
+                    if(value[j] < best_dist || (value[j] == best_dist && j < best)) {
+                        best = j;
+                        best_dist = value[j];
+                    }
+                }
+            }
+
+            // new group bounds from the exact distances and per center bounds of the visited groups
+            for(int g = 0; g < t; ++g) {
+                if(!visited[g]) continue;
+                lower[g] = 1e30f;
+                for(int j : state->members[g]) if(j != best) lower[g] = std::min(lower[g], value[j]);
+            }
+            // the old center lost its point and now counts towards the bound of its group
+            if(best != a0 && !visited[state->group[a0]]) {
+                lower[state->group[a0]] = std::min(lower[state->group[a0]], u);
+            }
+
+            if(best != a0) changed = true;
+            assignments[i] = best;
+            state->upper[i] = best_dist;
+        }
+        evals += count;
+        if(changed) converged = false;
+    }, 256);
+    *evaluations += evals;
+    state->prev_centers = centers;
+    return converged;
+}
+
+typedef struct {
+    const kd_tree_t* tree;                     // read only, restarts share one tree over the same data
+    std::vector<int> subtrees;                 // filtered independently, each into its own sums
+    std::vector<int> assignments;              // in tree order, copied to the model once converged
+    std::vector<std::vector<double> > sums;    // per subtree k x d sums of the points assigned to every center
+    std::vector<std::vector<long long> > counts;
+} filter_state_t;
+
+// squared L2 with the same multiply-adds as the kernels
+static inline float squared_dist(const float* x, const float* y, int d)
+{
+    float s = 0.f;
+    for(int j = 0; j < d; ++j) s = madd(x[j] - y[j], x[j] - y[j], s);
+    return s;
+}
+
+// true when every point of the box is further from z than from best. The corner of the box that favours z
+// the most is checked, with a small margin so rounding never prunes a center that the exact comparison in
+// the leaves could still pick. Ties are never pruned, they are resolved to the lowest index in the leaves
+static bool is_farther(const float* z, const float* best, const float* lo, const float* hi, int d)
+{
+    float dz = 0.f, db = 0.f;
+    for(int j = 0; j < d; ++j) {
+        const float v = z[j] > best[j] ? hi[j] : lo[j];
+        dz = madd(z[j] - v, z[j] - v, dz);
+        db = madd(best[j] - v, best[j] - v, db);
+    }
+    return dz > db*(1.f + 1e-5f);
+}
+
+typedef struct {
+    const kd_tree_t* tree;
+    const float* centers; // k x d
+    std::vector<std::vector<int> > candidates; // one list per depth
+    std::vector<float> mid;
+    double* sums;
+    long long* counts;
+    int* assignments; // in tree order
+    bool changed;
+    long long evaluations;
+} filter_job_t;
+
+static void assign_range(filter_job_t* job, int start, int end, int c)
+{
+    for(int i = start; i < end; ++i) {
+        if(job->assignments[i] != c) job->changed = true;
+        job->assignments[i] = c;
+    }
+}
+
+// Kanungo et al. filtering: the candidate closest to the middle of the node's box survives, every other
+// candidate that is further than it from the whole box is dropped for this node and all nodes below it.
+// A node left with one candidate goes to it as a whole, using the cached sum of its points
+static void filter_node(filter_job_t* job, int node, int depth, const int* candidates, int m)
+{
+    const kd_tree_t& tree = *job->tree;
+    const int d = tree.d;
+    const kd_node_t& n = tree.nodes[node];
+    const float* lo = &tree.lo[node*d];
+    const float* hi = &tree.hi[node*d];
+
+    std::vector<float>& mid = job->mid;
+    mid.resize(d);
+    for(int j = 0; j < d; ++j) mid[j] = 0.5f*(lo[j] + hi[j]);
+    int best = candidates[0];
+    float best_dist = squared_dist(mid.data(), job->centers + best*d, d);
+    for(int t = 1; t < m; ++t) {
+        const float dist = squared_dist(mid.data(), job->centers + candidates[t]*d, d);
+        if(dist < best_dist) { best_dist = dist; best = candidates[t]; }
+    }
+    job->evaluations += m;
+
+    if((int)job->candidates.size() <= depth) job->candidates.resize(depth + 1);
+    std::vector<int>& next = job->candidates[depth];
+    next.clear();
+    for(int t = 0; t < m; ++t) {
+        const int z = candidates[t];
+        if(z == best) {
+            next.push_back(z);
+            continue;
+        }
+        // is_farther measures z and best against the corner of the box
+        job->evaluations += 2;
+        if(!is_farther(job->centers + z*d, job->centers + best*d, lo, hi, d)) next.push_back(z);
+    }
+
+    if(next.size() == 1) {
+        for(int j = 0; j < d; ++j) job->sums[best*d + j] += tree.sum[node*d + j];
+        job->counts[best] += n.end - n.start;
+        assign_range(job, n.start, n.end, best);
+        return;
+    }
+    if(n.left >= 0) {
+        // next is overwritten further down, but only at deeper levels
+        filter_node(job, n.left, depth + 1, next.data(), next.size());
+        filter_node(job, n.right, depth + 1, job->candidates[depth].data(), job->candidates[depth].size());
+        return;
+    }
+
+    // leaf bucket: the remaining candidates in increasing order, so ties go to the lowest index
+    for(int i = n.start; i < n.end; ++i) {
+        const float* x = &tree.points[(size_t)i*d];
+        int c = next[0];
+        float c_dist = squared_dist(x, job->centers + c*d, d);
+        for(int t = 1; t < (int)next.size(); ++t) {
+            const float dist = squared_dist(x, job->centers + next[t]*d, d);
+            if(dist < c_dist) { c_dist = dist; c = next[t]; }
+        }
+        for(int j = 0; j < d; ++j) job->sums[c*d + j] += x[j];
+        job->counts[c]++;
+        assign_range(job, i, i + 1, c);
+    }
+    job->evaluations += (long long)(n.end - n.start)*next.size();
+}
+
+// Assignment and update step in one pass over the tree of the data. Returns true if no assignment changed,
+// otherwise moves the centers to the means of their points. Subtrees are fixed by the data and their sums are
+// added in a fixed order, so the result does not depend on the number of threads
+static bool kmeans_filter(const matrix_t& data, model_t* model, filter_state_t* state, long long* evaluations)
+{
+    const int k = model->centers.rows, d = model->centers.cols;
+    if(state->subtrees.empty()) {
+        state->subtrees = kd_tree_frontier(*state->tree, 6);
+        state->sums.resize(state->subtrees.size());
+        state->counts.resize(state->subtrees.size());
+        state->assignments.assign(data.rows, 0);
+    }
+
+    std::vector<float> centers(k*d);
+    for(int c = 0; c < k; ++c) std::copy(model->centers.vals[c].begin(), model->centers.vals[c].end(), &centers[c*d]);
+    std::vector<int> all(k);
+    for(int c = 0; c < k; ++c) all[c] = c;
+
+    std::atomic<bool> converged(true);
+    std::atomic<long long> evals(0);
+    parallel_for(state->subtrees.size(), [&](int start, int end) {
+        for(int s = start; s < end; ++s) {
+            state->sums[s].assign(k*d, 0.0);
+            state->counts[s].assign(k, 0);
+            filter_job_t job = {state->tree, centers.data(), {}, {}, state->sums[s].data(), state->counts[s].data(),
+                                state->assignments.data(), false, 0};
+            filter_node(&job, state->subtrees[s], 0, all.data(), k);
+            if(job.changed) converged = false;
+            evals += job.evaluations;
         }
+    }, 1);
+    *evaluations += evals;
+    if(converged) {
+        for(int i = 0; i < data.rows; ++i) model->assignments[state->tree->index[i]] = state->assignments[i];
+        return true;
     }
+
+    // empty clusters end up at the origin like in kmeans_maximization
+    for(int c = 0; c < k; ++c) {
+        long long count = 0;
+        for(int s = 0; s < (int)state->subtrees.size(); ++s) count += state->counts[s][c];
+        for(int j = 0; j < d; ++j) {
+            double sum = 0.0;
+            for(int s = 0; s < (int)state->subtrees.size(); ++s) sum += state->sums[s][c*d + j];
+            model->centers.vals[c][j] = count ? (float)(sum / count) : 0.f;
+        }
+    }
+    return false;
 }
 
-model_t kmeans(matrix_t data, int k, kmeans_metric_t metric, bool use_smart_centers)
+// cost of the assignments of the model, summed in order so it does not depend on the threads
+static double assignment_cost(const matrix_t& data, const model_t& model, kmeans_metric_t metric,
+                              const std::vector<float>* weights)
+{
+    std::vector<float> distance(data.rows);
+    parallel_for(data.rows, [&](int start, int end) {
+        for(int i = start; i < end; ++i) distance[i] = dist(data.vals[i], model.centers.vals[model.assignments[i]], metric);
+    }, 256);
+    double cost = 0.0;
+    for(int i = 0; i < data.rows; ++i) {
+        const double d = metric == L2 ? (double)distance[i]*distance[i] : distance[i];
+        cost += weights ? (*weights)[i]*d : d;
+    }
+    return cost;
+}
+
+// the algorithm kmeans runs for the requested one
+static kmeans_algorithm_t resolve_kmeans_algorithm(const matrix_t& data, int k, kmeans_metric_t metric,
+                                                   kmeans_algorithm_t algorithm, const std::vector<float>* weights)
+{
+    // 1 - IoU is not used with bounds, those boxes always go through lloyd
+    if(algorithm == KMEANS_AUTO) algorithm = choose_kmeans_algorithm(data.rows, k, data.cols);
+    if(metric == IOU) algorithm = KMEANS_LLOYD;
+    // the box pruning of the filtering algorithm is only valid for euclidean distances
+    // and its cached node sums are not weighted
+    if(algorithm == KMEANS_FILTER && (metric != L2 || weights)) algorithm = KMEANS_HAMERLY;
+    return algorithm;
+}
+
+// kmeans with an optional KD-tree of the data for the filtering algorithm, built here when it is NULL
+static model_t kmeans_run(const matrix_t& data, int k, kmeans_metric_t metric, bool use_smart_centers,
+                          kmeans_algorithm_t algorithm, kmeans_stats_t* stats, const std::vector<float>* weights,
+                          std::mt19937* gen, const kd_tree_t* tree)
 {
     if(metric == IOU) {
         for(int i = 0; i < data.rows; ++i) {
@@ -139,13 +866,309 @@ model_t kmeans(matrix_t data, int k, kmeans_metric_t metric, bool use_smart_cent
     std::vector<int> assignments(data.rows, 0);
     model_t model = {assignments, centers};
 
-    if(use_smart_centers) smart_centers(data, &model.centers, metric);
-    else random_centers(data, &model.centers);
+    // weighted data is a coreset and small, plain k-means++ with the weights is enough there
+    if(use_smart_centers && weights) smart_centers(data, &model.centers, metric, weights, gen);
+    else if(use_smart_centers) scalable_centers(data, &model.centers, metric, 5, 0.f, gen);
+    else random_centers(data, &model.centers, gen);
+
+    algorithm = resolve_kmeans_algorithm(data, k, metric, algorithm, weights);
+    elkan_state_t elkan;
+    hamerly_state_t hamerly;
+    yinyang_state_t yinyang;
+    filter_state_t filter;
+    kd_tree_t own_tree;
+    if(algorithm == KMEANS_FILTER && !tree) {
+        own_tree = make_kd_tree(data);
+        tree = &own_tree;
+    }
+    filter.tree = tree;
+    int iterations = 0;
+    long long evaluations = 0;
+
+    if(k == 1) kmeans_maximization(data, &model, weights);
+    for(;;) {
+        bool converged;
+        if(algorithm == KMEANS_ELKAN) {
+            converged = kmeans_expectation_elkan(data, &model, metric, &elkan, &evaluations);
+        }
+        else if(algorithm == KMEANS_HAMERLY) {
+            converged = kmeans_expectation_hamerly(data, &model, metric, &hamerly, &evaluations);
+        }
+        else if(algorithm == KMEANS_YINYANG) {
+            converged = kmeans_expectation_yinyang(data, &model, metric, &yinyang, &evaluations);
+        }
+        else if(algorithm == KMEANS_FILTER) {
+            // also moves the centers
+            converged = kmeans_filter(data, &model, &filter, &evaluations);
+            iterations++;
+            if(converged) break;
+            continue;
+        }
+        else {
+            converged = kmeans_expectation(data, &model, metric);
+            evaluations += (long long)data.rows*k;
+        }
+        iterations++;
+        if(converged) break;
+        kmeans_maximization(data, &model, weights);
+    }
+
+    if(stats) {
+        stats->iterations = iterations;
+        stats->distance_evaluations = evaluations;
+        stats->inertia = k > 0 ? assignment_cost(data, model, metric, weights) : 0.0;
+    }
+    return model;
+}
+
+model_t kmeans(const matrix_t& data, int k, kmeans_metric_t metric, bool use_smart_centers,
+               kmeans_algorithm_t algorithm, kmeans_stats_t* stats, const std::vector<float>* weights,
+               std::mt19937* gen)
+{
+    return kmeans_run(data, k, metric, use_smart_centers, algorithm, stats, weights, gen, NULL);
+}
+
+model_t kmeans_restarts(const matrix_t& data, int k, kmeans_metric_t metric, const kmeans_restart_options_t& opt,
+                        std::vector<kmeans_run_t>* runs, const std::vector<float>* weights)
+{
+    const int n_init = std::max(1, opt.n_init);
+    std::vector<model_t> models(n_init);
+    std::vector<kmeans_run_t> results(n_init);
+    // the data only ever gets read, the filtering algorithm's tree over it is built once for all runs
+    const kmeans_algorithm_t algorithm = resolve_kmeans_algorithm(data, k, metric, opt.algorithm, weights);
+    kd_tree_t tree;
+    if(algorithm == KMEANS_FILTER) tree = make_kd_tree(data);
+
+    // Every run draws from its own generator seeded with (seed, run), so the results do not depend on the
+    // order the runs finish
+    auto run = [&](int r) {
+        std::seed_seq seq{opt.seed, (unsigned int)r};
+        std::mt19937 gen(seq);
+        results[r].seed = opt.seed;
+        results[r].run = r;
+        models[r] = kmeans_run(data, k, metric, opt.use_smart_centers, algorithm, &results[r].stats, weights, &gen, &tree);
+    };
+    // one restart per task, the parallel loops inside a run then run serially on its thread. With fewer
+    // restarts than threads that would leave threads idle, so the runs go one after the other instead and
+    // each uses the whole pool
+    if(n_init < get_num_threads()) {
+        for(int r = 0; r < n_init; ++r) run(r);
+    }
+    else {
+        parallel_for(n_init, [&](int start, int end) {
+            for(int r = start; r < end; ++r) run(r);
+        }, 1);
+    }
+
+    // ties go to the earliest run
+    int best = 0;
+    for(int r = 1; r < n_init; ++r) if(results[r].stats.inertia < results[best].stats.inertia) best = r;
+    if(runs) *runs = results;
+    return models[best];
+}
+
+double kmeans_cost(const matrix_t& data, const matrix_t& centers, kmeans_metric_t metric, const std::vector<float>* weights)
+{
+    if(data.rows == 0 || centers.rows == 0) return 0.0;
+    const center_block_t block = make_center_block(centers);
+    std::vector<float> distance(data.rows);
+    parallel_for(data.rows, [&](int start, int end) {
+        std::vector<int> index(end - start);
+        closest_centers(data, start, end, block, metric, index.data(), &distance[start]);
+    }, 256);
+    // summed in order so the cost does not depend on the threads
+    double cost = 0.0;
+    for(int i = 0; i < data.rows; ++i) {
+        const double d = metric == L2 ? (double)distance[i]*distance[i] : distance[i];
+        cost += weights ? (*weights)[i]*d : d;
+    }
+    return cost;
+}
+
+coreset_t make_coreset(const matrix_t& data, int k, int size, kmeans_metric_t metric, unsigned int seed)
+{
+    coreset_t coreset;
+    const int n = data.rows;
+    if(n <= size || k <= 0) {
+        coreset.points = data;
+        coreset.weights.assign(n, 1.f);
+        return coreset;
+    }
+
+    // rough solution B: k-means++ on a uniform sample. Any B works, a better one gives a smaller error
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> pick(0, n - 1);
+    const int sample_size = std::min(n, std::max(1000, 20*k));
+    matrix_t sample = make_matrix(sample_size, data.cols);
+    for(int i = 0; i < sample_size; ++i) sample.vals[i] = data.vals[pick(gen)];
+    matrix_t rough = make_matrix(std::min(k, sample_size), data.cols);
+    smart_centers(sample, &rough, metric, NULL, &gen);
+
+    // first pass: cost of every point under B, and the size and cost of every cluster of B
+    const center_block_t block = make_center_block(rough);
+    std::vector<int> owner(n);
+    std::vector<float> cost(n);
+    parallel_for(n, [&](int start, int end) {
+        closest_centers(data, start, end, block, metric, &owner[start], &cost[start]);
+        if(metric == L2) for(int i = start; i < end; ++i) cost[i] *= cost[i];
+    }, 256);
+    std::vector<double> cluster_cost(rough.rows, 0.0);
+    std::vector<int> cluster_size(rough.rows, 0);
+    double total_cost = 0.0;
+    for(int i = 0; i < n; ++i) {
+        cluster_cost[owner[i]] += cost[i];
+        cluster_size[owner[i]]++;
+        total_cost += cost[i];
+    }
+
+    // second pass: upper bound on the sensitivity of every point (Bachem et al. 2017): its own share
+    // of the cost, the average share of its cluster, and a term for being in a small cluster
+    const double mean_cost = std::max(total_cost / n, 1e-30);
+    const double alpha = 16.0*(log((double)k) + 2.0);
+    std::vector<double> sensitivity(n);
+    parallel_for(n, [&](int start, int end) {
+        for(int i = start; i < end; ++i) {
+            const int c = owner[i];
+            sensitivity[i] = alpha*cost[i] / mean_cost + 2.0*alpha*cluster_cost[c] / (cluster_size[c]*mean_cost)
+                           + 4.0*n / cluster_size[c];
+        }
+    }, 256);
+    for(int i = 1; i < n; ++i) sensitivity[i] += sensitivity[i-1];
+    const double total = sensitivity[n-1];
+
+    // sample with probability proportional to the sensitivity, each point stands for 1 / (size * probability) rows
+    std::uniform_real_distribution<double> uniform(0.0, total);
+    coreset.points = make_matrix(size, data.cols);
+    coreset.weights.resize(size);
+    for(int s = 0; s < size; ++s) {
+        const int i = std::min(n - 1, (int)(std::upper_bound(sensitivity.begin(), sensitivity.end(), uniform(gen)) - sensitivity.begin()));
+        const double p = (sensitivity[i] - (i ? sensitivity[i-1] : 0.0)) / total;
+        coreset.points.vals[s] = data.vals[i];
+        coreset.weights[s] = 1.0 / (size*p);
+    }
+    return coreset;
+}
 
-    if(k == 1) kmeans_maximization(data, &model);
-    while(!kmeans_expectation(data, &model, metric)) {
-        kmeans_maximization(data, &model);
+model_t coreset_kmeans(const matrix_t& data, int k, kmeans_metric_t metric, const coreset_options_t& opt, kmeans_stats_t* stats)
+{
+    const coreset_t coreset = make_coreset(data, k, opt.size, metric, opt.seed);
+    std::mt19937 gen(opt.seed);
+    model_t model = kmeans(coreset.points, k, metric, true, opt.algorithm, stats, &coreset.weights, &gen);
+    model.assignments.clear();
+    if(opt.assign_all && model.centers.rows > 0) {
+        model.assignments.resize(data.rows);
+        const center_block_t block = make_center_block(model.centers);
+        parallel_for(data.rows, [&](int start, int end) {
+            closest_centers(data, start, end, block, metric, &model.assignments[start], NULL);
+        }, 256);
+        if(stats) {
+            stats->distance_evaluations += (long long)data.rows*k;
+            stats->inertia = assignment_cost(data, model, metric, NULL);
+        }
     }
+    return model;
+}
 
+kmeans_source_t make_matrix_source(const matrix_t& data, unsigned int seed)
+{
+    std::shared_ptr<std::mt19937> gen = std::make_shared<std::mt19937>(seed);
+    return [&data, gen](int batch_size, matrix_t* batch) {
+        if(data.rows == 0) return 0;
+        std::uniform_int_distribution<int> pick(0, data.rows - 1);
+        batch->rows = batch_size;
+        batch->cols = data.cols;
+        batch->vals.resize(batch_size);
+        for(int i = 0; i < batch_size; ++i) {
+            const std::vector<float>& row = data.vals[pick(*gen)];
+            batch->vals[i].assign(row.begin(), row.end());
+        }
+        return batch_size;
+    };
+}
+
+kmeans_source_t make_csv_source(const std::string& filename)
+{
+    std::shared_ptr<std::ifstream> file = std::make_shared<std::ifstream>(filename);
+    if(!file->good()) fprintf(stderr, "Error: %s\n", filename.c_str());
+
+    return [file](int batch_size, matrix_t* batch) {
+        batch->vals.resize(batch_size);
+        int n = 0;
+        bool restarted = false;
+        std::string line;
+        while(n < batch_size) {
+            if(!std::getline(*file, line)) {
+                // start the next pass over the file, an empty file ends the run
+                if(restarted) break;
+                restarted = true;
+                file->clear();
+                file->seekg(0);
+                continue;
+            }
+            std::vector<float> row = parse_row(line);
+            if(row.empty()) continue;
+            batch->vals[n++].swap(row);
+        }
+        batch->vals.resize(n);
+        batch->rows = n;
+        batch->cols = n ? batch->vals[0].size() : 0;
+        return n;
+    };
+}
+
+model_t minibatch_kmeans(const kmeans_source_t& source, int k, kmeans_metric_t metric,
+                         const minibatch_options_t& opt, kmeans_stats_t* stats)
+{
+    matrix_t batch = make_matrix(0, 0);
+    model_t model;
+    const int n_init = source(std::max(opt.batch_size, 3*k), &batch);
+    k = std::min(k, n_init);
+    model.centers = make_matrix(k, batch.cols);
+    if(k == 0) return model;
+    std::mt19937 gen(opt.seed);
+    smart_centers(batch, &model.centers, metric, NULL, &gen);
+    long long evaluations = (long long)n_init*k;
+
+    std::vector<long long> counts(k, 0);
+    std::vector<int> assignments;
+    std::vector<float> distances;
+    const float alpha = 0.1f;
+    float smoothed = -1.f, best = 1e30f;
+    int batches = 0, no_improvement = 0;
+    while(batches < opt.max_batches) {
+        const int n = source(opt.batch_size, &batch);
+        if(n == 0) break;
+        batches++;
+
+        // assign the whole batch first, so every point sees the same centers
+        assignments.resize(n);
+        distances.resize(n);
+        closest_centers(batch, 0, n, make_center_block(model.centers), metric, assignments.data(), distances.data());
+        double inertia = 0.0;
+        for(int i = 0; i < n; ++i) inertia += metric == L2 ? distances[i]*distances[i] : distances[i];
+        evaluations += (long long)n*k;
+
+        for(int i = 0; i < n; ++i) {
+            const int c = assignments[i];
+            const float eta = 1.f / ++counts[c];
+            std::vector<float>& center = model.centers.vals[c];
+            for(int j = 0; j < batch.cols; ++j) center[j] += eta * (batch.vals[i][j] - center[j]);
+        }
+
+        // single batches are noisy, so convergence looks at an exponentially weighted average
+        const float mean_inertia = inertia / n;
+        smoothed = smoothed < 0.f ? mean_inertia : (1.f - alpha)*smoothed + alpha*mean_inertia;
+        if(smoothed < best*(1.f - opt.tolerance)) {
+            best = smoothed;
+            no_improvement = 0;
+        }
+        else if(++no_improvement >= opt.max_no_improvement) break;
+    }
+
+    if(stats) {
+        stats->iterations = batches;
+        stats->distance_evaluations = evaluations;
+        stats->inertia = 0.0;
+    }
     return model;
 }
@@ -1,5 +1,6 @@
 #include "vdb/vdb.h"
 #include "image.h"
+#include "image_writer.h"
 #include "filter_image.h"
 #include "color_utils.h"
 #include "utilities.h"
@@ -11,6 +12,15 @@
 #include "regression.h"
 #include "rng.h"
 #include "connected_components.h"
+#include "edge_detection.h"
+#include "histogram.h"
+#include "integral_image.h"
+#include "resample.h"
+#include "thread_pool.h"
+#include "contours.h"
+#include "distance_transform.h"
+#include "distance_kernels.h"
+#include "anchors.h"
 
 #include "vdb/imguifilesystem.h"
 
@@ -20,6 +30,7 @@
 #include <cmath>
 #include <ctime>
 #include <map>
+#include <algorithm>
 
 typedef enum {
     KMEANS_CLUSTER,
@@ -160,17 +171,53 @@ void plot_data(const matrix_t& data)
     }
 }
 
-void draw_connected_components(image_t* image, const std::vector<int>& label, const std::vector<std::pair<int,int> >& points)
+void draw_connected_components(image_t* image, const std::vector<int>& label, const run_mask_t& runs, const component_stats_t& stats, bool draw_boxes)
 {
-    for (int i = 0; i < points.size(); ++i) {
-        std::pair<int,int> p = points[i];
-        int x = p.first, y = p.second;
-        int l = label[y*image->w + x];
-
-        vdb_color c = vdbPalette(l);
-        set_pixel(image, x, y, 0, c.r);
-        set_pixel(image, x, y, 1, c.g);
-        set_pixel(image, x, y, 2, c.b);
+    std::vector<vdb_color> colors(stats.count);
+    for (int l = 0; l < stats.count; ++l) colors[l] = vdbPalette(l);
+
+    for (int y = 0; y < runs.h; ++y) {
+        for (int i = runs.row_start[y]; i < runs.row_start[y+1]; ++i) {
+            if (label[i] < 0) continue;
+            vdb_color c = colors[label[i]];
+            for (int x = runs.runs[i].x0; x < runs.runs[i].x1; ++x) {
+                set_pixel(image, x, y, 0, c.r);
+                set_pixel(image, x, y, 1, c.g);
+                set_pixel(image, x, y, 2, c.b);
+            }
+        }
+    }
+
+    if (!draw_boxes) return;
+    for (int l = 0; l < stats.count; ++l) {
+        for (int x = stats.x0[l]; x <= stats.x1[l]; ++x) {
+            for (int k = 0; k < 3; ++k) {
+                set_pixel(image, x, stats.y0[l], k, 1.f);
+                set_pixel(image, x, stats.y1[l], k, 1.f);
+            }
+        }
+        for (int y = stats.y0[l]; y <= stats.y1[l]; ++y) {
+            for (int k = 0; k < 3; ++k) {
+                set_pixel(image, stats.x0[l], y, k, 1.f);
+                set_pixel(image, stats.x1[l], y, k, 1.f);
+            }
+        }
+    }
+}
+
+// contours are in pixel coordinates of a w x h image that fills the view
+void draw_contours(const std::vector<contour_t>& contours, int w, int h)
+{
+    for (const contour_t& contour : contours) {
+        if (contour.is_hole) glColor4f(1, 0.5f, 0, 1);
+        else glColor4f(1, 1, 1, 1);
+        glLineWidth(2.0f);
+        glBegin(GL_LINE_STRIP);
+        for (int i = 0; i <= contour.points.size(); ++i) {
+            contour_point_t p = contour.points[i % contour.points.size()];
+            glVertex2f(-1.f + 2.f*(p.x + 0.5f)/w, -1.f + 2.f*(p.y + 0.5f)/h);
+        }
+        glEnd();
     }
 }
 
@@ -291,6 +338,7 @@ int main(int, char **)
 
             static bool use_smart_centers = false;
             ImGui::Checkbox("K-means++", &use_smart_centers);
+            ImGui::SameLine(); ShowHelpMarker("Seeds with k-means||, parallel oversampling followed by k-means++ on the candidates.");
 
             // choose metrics
             static int metric = L2;
@@ -298,13 +346,72 @@ int main(int, char **)
             ImGui::RadioButton("L2",  &metric, L2); ImGui::SameLine();
             ImGui::RadioButton("IOU", &metric, IOU);
 
+            static const char* algorithm_items[] = { "lloyd", "elkan", "hamerly", "yinyang", "filter", "auto" };
+            static int algorithm_item = 0;
+            ImGui::Combo("algorithm", &algorithm_item, algorithm_items, IM_ARRAYSIZE(algorithm_items));
+            ImGui::SameLine(); ShowHelpMarker("Elkan, Hamerly and Yinyang skip distances with the triangle inequality and give the same assignments as lloyd up to float rounding. Filter assigns whole KD-tree nodes at once (L2 only). Auto picks one from n, k and the dimension. IOU always uses lloyd.");
+
+            static bool use_minibatch = false;
+            static minibatch_options_t minibatch_opt;
+            ImGui::Checkbox("mini-batch", &use_minibatch);
+            if(use_minibatch) {
+                ImGui::SameLine();
+                ImGui::SliderInt("batch size", &minibatch_opt.batch_size, 16, 4096);
+            }
+            static bool use_coreset = false;
+            static coreset_options_t coreset_opt;
+            ImGui::Checkbox("coreset", &use_coreset);
+            if(use_coreset) {
+                ImGui::SameLine();
+                ImGui::SliderInt("coreset size", &coreset_opt.size, 100, 10000);
+                ImGui::SameLine(); ShowHelpMarker("Clusters a weighted sample of the data picked by sensitivity sampling, then assigns every point to the centers.");
+            }
+
+            static int n_init = 1;
+            ImGui::SliderInt("restarts", &n_init, 1, 16);
+            ImGui::SameLine(); ShowHelpMarker("Independent runs at the same time on the thread pool, the one with the lowest inertia is kept.");
+
+            static kmeans_stats_t kmeans_stats = {0, 0, 0.0};
+            static std::vector<kmeans_run_t> kmeans_runs;
+            static double kmeans_time = 0.0;
             if(colored_button("Run K-means", 2.f/7.f)) {
                 data_types.clear();
                 centroid_colors.clear();
                 cluster_data_colors.clear();
                 if(metric == IOU) clear_image(&image);
 
-                model_t model = kmeans(data, k, (kmeans_metric_t)metric, use_smart_centers);
+                double start = time_now();
+                model_t model;
+                kmeans_runs.clear();
+                if(use_minibatch) {
+                    model = minibatch_kmeans(make_matrix_source(data), k, (kmeans_metric_t)metric, minibatch_opt, &kmeans_stats);
+                    model.assignments.assign(data.rows, 0);
+                    if(model.centers.rows > 0) {
+                        closest_centers(data, 0, data.rows, make_center_block(model.centers), (kmeans_metric_t)metric,
+                                        model.assignments.data(), NULL);
+                    }
+                }
+                else if(use_coreset && k > 0) {
+                    coreset_opt.algorithm = get_kmeans_algorithm(algorithm_items[algorithm_item]);
+                    model = coreset_kmeans(data, k, (kmeans_metric_t)metric, coreset_opt, &kmeans_stats);
+                }
+                else if(n_init > 1 && k > 0) {
+                    kmeans_restart_options_t restart_opt;
+                    restart_opt.n_init = n_init;
+                    restart_opt.use_smart_centers = use_smart_centers;
+                    restart_opt.algorithm = get_kmeans_algorithm(algorithm_items[algorithm_item]);
+                    restart_opt.seed = rand();
+                    model = kmeans_restarts(data, k, (kmeans_metric_t)metric, restart_opt, &kmeans_runs);
+                    kmeans_stats = kmeans_runs[0].stats;
+                    for(const kmeans_run_t& run : kmeans_runs) {
+                        if(run.stats.inertia < kmeans_stats.inertia) kmeans_stats = run.stats;
+                    }
+                }
+                else {
+                    model = kmeans(data, k, (kmeans_metric_t)metric, use_smart_centers,
+                                   get_kmeans_algorithm(algorithm_items[algorithm_item]), &kmeans_stats);
+                }
+                kmeans_time = time_now() - start;
                 centroids = model.centers;
 
                 auto colors = get_colors(k);
@@ -329,6 +436,169 @@ int main(int, char **)
                 }
             }
 
+            ImGui::Text("%d iterations, %lld distance evaluations, inertia %.4f, %.2f ms", kmeans_stats.iterations,
+                        kmeans_stats.distance_evaluations, kmeans_stats.inertia, 1000*kmeans_time);
+            if(!kmeans_runs.empty() && ImGui::TreeNode("restarts")) {
+                for(const kmeans_run_t& run : kmeans_runs) {
+                    ImGui::Text("run %2d: inertia %.4f, %d iterations", run.run, run.stats.inertia, run.stats.iterations);
+                }
+                ImGui::TreePop();
+            }
+
+            // elbow plot: one coreset is built for the largest k and reused, so a whole sweep stays interactive
+            static std::vector<float> sweep_cost;
+            static double sweep_time = 0.0;
+            if(colored_button("k sweep", 6.f/7.f) && data.rows > 0) {
+                const int max_k = std::min(20, data.rows);
+                double start = time_now();
+                coreset_t coreset = make_coreset(data, max_k, coreset_opt.size, (kmeans_metric_t)metric);
+                sweep_cost.clear();
+                for(int kk = 1; kk <= max_k; ++kk) {
+                    model_t model = kmeans(coreset.points, kk, (kmeans_metric_t)metric, true, KMEANS_AUTO, NULL, &coreset.weights);
+                    sweep_cost.push_back(kmeans_cost(coreset.points, model.centers, (kmeans_metric_t)metric, &coreset.weights));
+                }
+                sweep_time = time_now() - start;
+            }
+            if(!sweep_cost.empty()) {
+                ImGui::PlotLines("cost over k", sweep_cost.data(), sweep_cost.size(), 0, NULL, 0.f, FLT_MAX, ImVec2(0, 80));
+                ImGui::Text("k = 1..%d in %.2f ms", (int)sweep_cost.size(), 1000*sweep_time);
+            }
+
+            // same data, k and random initialization for both, so the runs are directly comparable
+            static std::string benchmark_result;
+            if(colored_button("Benchmark lloyd vs elkan", 3.f/7.f) && k > 0 && data.rows >= k) {
+                kmeans_stats_t lloyd_stats, elkan_stats;
+                srand(0);
+                double start = time_now();
+                model_t lloyd = kmeans(data, k, L2, false, KMEANS_LLOYD, &lloyd_stats);
+                double lloyd_time = time_now() - start;
+                srand(0);
+                start = time_now();
+                model_t elkan = kmeans(data, k, L2, false, KMEANS_ELKAN, &elkan_stats);
+                double elkan_time = time_now() - start;
+
+                char buffer[512];
+                snprintf(buffer, sizeof(buffer), "lloyd: %.2f ms, %lld distances\nelkan: %.2f ms, %lld distances\n"
+                         "%.1f%% of the distances saved, %.2fx faster, %s assignments",
+                         1000*lloyd_time, lloyd_stats.distance_evaluations, 1000*elkan_time, elkan_stats.distance_evaluations,
+                         100.0*(1.0 - (double)elkan_stats.distance_evaluations / lloyd_stats.distance_evaluations),
+                         lloyd_time / elkan_time, lloyd.assignments == elkan.assignments ? "identical" : "different");
+                benchmark_result = buffer;
+            }
+            if(!benchmark_result.empty()) ImGui::TextWrapped("%s", benchmark_result.c_str());
+
+            // a million 2-D points around 50 random centers, the size where lloyd gets slow
+            static std::string filter_result;
+            if(colored_button("Benchmark filter (n = 10^6, k = 50)", 4.f/7.f)) {
+                const int n = 1000000, num_clusters = 50;
+                std::mt19937 gen(0);
+                std::uniform_real_distribution<float> uniform(0.f, 1.f);
+                std::normal_distribution<float> noise(0.f, 0.05f);
+                matrix_t means = make_matrix(num_clusters, 2);
+                for(int c = 0; c < num_clusters; ++c) means.vals[c] = {uniform(gen), uniform(gen)};
+                matrix_t points = make_matrix(n, 2);
+                for(int i = 0; i < n; ++i) {
+                    const std::vector<float>& mean = means.vals[i % num_clusters];
+                    points.vals[i] = {mean[0] + noise(gen), mean[1] + noise(gen)};
+                }
+
+                kmeans_stats_t lloyd_stats, filter_stats;
+                srand(0);
+                double start = time_now();
+                model_t lloyd = kmeans(points, num_clusters, L2, false, KMEANS_LLOYD, &lloyd_stats);
+                double lloyd_time = time_now() - start;
+                srand(0);
+                start = time_now();
+                model_t filter = kmeans(points, num_clusters, L2, false, KMEANS_FILTER, &filter_stats);
+                double filter_time = time_now() - start;
+
+                char buffer[512];
+                snprintf(buffer, sizeof(buffer), "lloyd: %.2f s, %d iterations, %lld distances\n"
+                         "filter: %.2f s, %d iterations, %lld distances (tree included)\n%.2fx faster, %s assignments",
+                         lloyd_time, lloyd_stats.iterations, lloyd_stats.distance_evaluations,
+                         filter_time, filter_stats.iterations, filter_stats.distance_evaluations,
+                         lloyd_time / filter_time, lloyd.assignments == filter.assignments ? "identical" : "different");
+                filter_result = buffer;
+            }
+            if(!filter_result.empty()) ImGui::TextWrapped("%s", filter_result.c_str());
+
+            // the update step reduces fixed blocks in a fixed order, so every thread count gives the same centers
+            static const int max_threads = get_num_threads();
+            static std::vector<double> scaling_times;
+            static bool scaling_identical = true;
+            if(colored_button("Thread scaling", 5.f/7.f) && k > 0 && data.rows >= k) {
+                scaling_times.clear();
+                scaling_identical = true;
+                model_t first;
+                for(int t = 1; t <= max_threads; ++t) {
+                    set_num_threads(t);
+                    srand(0);
+                    double start = time_now();
+                    model_t model = kmeans(data, k, L2, false, get_kmeans_algorithm(algorithm_items[algorithm_item]));
+                    scaling_times.push_back(time_now() - start);
+                    if(t == 1) first = model;
+                    else scaling_identical &= model.centers.vals == first.centers.vals;
+                }
+                set_num_threads(max_threads);
+            }
+            for(int t = 0; t < scaling_times.size(); ++t) {
+                ImGui::Text("%2d threads: %.2f ms (%.2fx)", t+1, 1000*scaling_times[t], scaling_times[0] / scaling_times[t]);
+            }
+            if(!scaling_times.empty()) ImGui::Text("centers %s across thread counts", scaling_identical ? "identical" : "different");
+
+            // anchor boxes for a detector, clustered from a folder of YOLO labels or COCO json files
+            static ImGuiFs::Dialog label_dialog;
+            static const char* box_format_items[] = { "yolo", "coco" };
+            static int box_format_item = 0;
+            static int num_anchors = 9;
+            static bool stream_labels = false;
+            static std::string label_path;
+            static box_set_t boxes = box_set_t();
+            static double boxes_time = 0.0;
+            static anchor_result_t anchor_result = anchor_result_t();
+            static double anchor_time = 0.0;
+            ImGui::Combo("label format", &box_format_item, box_format_items, IM_ARRAYSIZE(box_format_items));
+            ImGui::SliderInt("anchors", &num_anchors, 1, 15);
+            ImGui::Checkbox("stream from disk", &stream_labels);
+            ImGui::SameLine(); ShowHelpMarker("Mini-batch k-means straight from the label files, memory stays the same for any dataset size.");
+            const char* chosen_label_path = label_dialog.chooseFolderDialog(colored_button("Load labels", 1.f/7.f));
+            if(strcmp(chosen_label_path, "") != 0) {
+                label_path = chosen_label_path;
+                double start = time_now();
+                if(!stream_labels) boxes = load_boxes(label_path, get_box_format(box_format_items[box_format_item]));
+                boxes_time = time_now() - start;
+            }
+            if(!label_path.empty()) {
+                if(!stream_labels) ImGui::Text("%d boxes loaded in %.2f ms", boxes.n, 1000*boxes_time);
+                if(colored_button("Cluster anchors", 2.f/7.f)) {
+                    double start = time_now();
+                    if(stream_labels) {
+                        anchor_result = anchor_kmeans(label_path, get_box_format(box_format_items[box_format_item]), num_anchors);
+                    }
+                    else anchor_result = anchor_kmeans(boxes, num_anchors);
+                    anchor_time = time_now() - start;
+
+                    // normalized YOLO sizes are drawn like the anchors of the IOU k-means above
+                    metric = IOU;
+                    clear_image(&image);
+                    auto colors = get_colors(anchor_result.anchors.rows);
+                    for(int a = 0; a < anchor_result.anchors.rows; ++a) {
+                        float width = std::min(1.f, anchor_result.anchors.vals[a][0]), height = std::min(1.f, anchor_result.anchors.vals[a][1]);
+                        draw_box(&image,
+                                 image.w/2 - (image.w*width)/2, image.h/2 - (image.h*height)/2,
+                                 image.w/2 + (image.w*width)/2, image.h/2 + (image.h*height)/2,
+                                 colors[a].r, colors[a].g, colors[a].b);
+                    }
+                }
+            }
+            if(anchor_result.anchors.rows > 0) {
+                ImGui::Text("average best IoU %.4f, %d iterations, %.2f ms", anchor_result.average_iou,
+                            anchor_result.iterations, 1000*anchor_time);
+                for(int a = 0; a < anchor_result.anchors.rows; ++a) {
+                    ImGui::Text("%.4f x %.4f", anchor_result.anchors.vals[a][0], anchor_result.anchors.vals[a][1]);
+                }
+            }
+
             if(metric == IOU) {
                 ImGui::TextWrapped("Below is a visualization of the anchor boxes. Hover for a zoomed view!");
                 ImVec2 tex_screen_pos = ImGui::GetCursorScreenPos();
@@ -360,5 +630,6 @@ int main(int, char **)
 
     #include "gui_content/regression_gui.cpp"
 
+    wait_image_writes();
     return 0;
 }
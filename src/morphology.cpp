@@ -0,0 +1,215 @@
+#include "morphology.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+morph_op_t get_morph_op(const char* s)
+{
+    if(strcmp(s, "erode") == 0) return MORPH_ERODE;
+    if(strcmp(s, "dilate") == 0) return MORPH_DILATE;
+    if(strcmp(s, "open") == 0) return MORPH_OPEN;
+    if(strcmp(s, "close") == 0) return MORPH_CLOSE;
+    return MORPH_OPEN;
+}
+
+// van Herk/Gil-Werman running min/max over n rows of len elements each, row i starting at in + i*stride.
+// out[i] = op(in[i-radius], ..., in[i+radius]) element-wise. The padded sequence is cut into blocks of
+// size 2*radius+1, g holds prefix results and h suffix results within each block, so every window is
+// exactly one suffix combined with one prefix.
+template <typename T, typename Op>
+static void van_herk_gil_werman(const T* in, int n, int stride, int len, int radius, T neutral, Op op,
+                                T* out, std::vector<T>& g, std::vector<T>& h)
+{
+    const int k = 2*radius+1, padded = n + 2*radius;
+    g.resize(padded*len);
+    h.resize(padded*len);
+
+    for(int p = 0, b = 0; p < padded; ++p, b = b == k-1 ? 0 : b+1) {
+        const int i = p - radius;
+        const T* src = (i >= 0 && i < n) ? &in[i*stride] : NULL;
+        T* dst = &g[p*len];
+        if(b == 0) {
+            for(int j = 0; j < len; ++j) dst[j] = src ? src[j] : neutral;
+        }
+        else {
+            const T* prev = &g[(p-1)*len];
+            if(src) for(int j = 0; j < len; ++j) dst[j] = op(prev[j], src[j]);
+            else for(int j = 0; j < len; ++j) dst[j] = op(prev[j], neutral);
+        }
+    }
+    for(int p = padded-1, b = (padded-1) % k; p >= 0; --p, b = b == 0 ? k-1 : b-1) {
+        const int i = p - radius;
+        const T* src = (i >= 0 && i < n) ? &in[i*stride] : NULL;
+        T* dst = &h[p*len];
+        if(b == k-1 || p == padded-1) {
+            for(int j = 0; j < len; ++j) dst[j] = src ? src[j] : neutral;
+        }
+        else {
+            const T* next = &h[(p+1)*len];
+            if(src) for(int j = 0; j < len; ++j) dst[j] = op(next[j], src[j]);
+            else for(int j = 0; j < len; ++j) dst[j] = op(next[j], neutral);
+        }
+    }
+    for(int i = 0; i < n; ++i) {
+        const T* hs = &h[i*len];
+        const T* gs = &g[(i + 2*radius)*len];
+        T* dst = &out[i*stride];
+        for(int j = 0; j < len; ++j) dst[j] = op(hs[j], gs[j]);
+    }
+}
+
+template <typename Op>
+static void morph_image(const image_t& in, int rx, int ry, float neutral, Op op, image_t* out)
+{
+    const int w = in.w, h = in.h;
+    image_t tmp = make_image(w, h, in.c);
+    *out = make_image(w, h, in.c);
+
+    for(int c = 0; c < in.c; ++c) {
+        const float* src = &in.data[c*w*h];
+        float* mid = &tmp.data[c*w*h];
+        float* dst = &out->data[c*w*h];
+
+        // along x every pixel of a row is its own "row" of length 1
+        parallel_for(h, [&](int start, int end) {
+            std::vector<float> g, hs;
+            for(int y = start; y < end; ++y) {
+                van_herk_gil_werman(&src[y*w], w, 1, 1, rx, neutral, op, &mid[y*w], g, hs);
+            }
+        }, 16);
+
+        // along y whole row segments are combined at once, which vectorizes
+        parallel_for(w, [&](int start, int end) {
+            std::vector<float> g, hs;
+            van_herk_gil_werman(&mid[start], h, w, end - start, ry, neutral, op, &dst[start], g, hs);
+        }, 64);
+    }
+}
+
+void erode_image(const image_t& in, int rx, int ry, image_t* out)
+{
+    morph_image(in, rx, ry, std::numeric_limits<float>::infinity(),
+                [](float a, float b) { return a < b ? a : b; }, out);
+}
+
+void dilate_image(const image_t& in, int rx, int ry, image_t* out)
+{
+    morph_image(in, rx, ry, -std::numeric_limits<float>::infinity(),
+                [](float a, float b) { return a > b ? a : b; }, out);
+}
+
+void morphology_image(const image_t& in, morph_op_t op, int rx, int ry, image_t* out)
+{
+    image_t tmp;
+    switch(op) {
+        case MORPH_ERODE:
+            erode_image(in, rx, ry, out);
+            break;
+        case MORPH_DILATE:
+            dilate_image(in, rx, ry, out);
+            break;
+        case MORPH_OPEN:
+            erode_image(in, rx, ry, &tmp);
+            dilate_image(tmp, rx, ry, out);
+            break;
+        case MORPH_CLOSE:
+            dilate_image(in, rx, ry, &tmp);
+            erode_image(tmp, rx, ry, out);
+            break;
+    }
+}
+
+// dst bit x = src bit x+s, bits coming from outside src are taken from fill
+static void shift_row(const uint64_t* src, int src_words, int s, uint64_t fill, uint64_t* dst, int dst_words)
+{
+    const int q = s >= 0 ? s / 64 : -((-s + 63) / 64), r = s - 64*q;
+    for(int i = 0; i < dst_words; ++i) {
+        const int a = i + q, b = i + q + 1;
+        const uint64_t lo = (a >= 0 && a < src_words) ? src[a] : fill;
+        const uint64_t hi = (b >= 0 && b < src_words) ? src[b] : fill;
+        dst[i] = r == 0 ? lo : (lo >> r) | (hi << (64 - r));
+    }
+}
+
+// Along a packed row the window is built by doubling: after step j every bit holds the result of
+// the 2^j pixels starting at it, so a window of 2*radius+1 pixels costs O(log radius) word operations
+// per 64 pixels. The row is first shifted right by radius into a buffer wide enough for the whole
+// window of the last pixel, so every window starts at the bit of the pixel it belongs to.
+template <typename Op>
+static void morph_mask_row(const uint64_t* in, int w, int words, int radius, uint64_t fill, Op op,
+                           uint64_t* out, std::vector<uint64_t>& p, std::vector<uint64_t>& tmp)
+{
+    const int window = 2*radius+1, ext_words = (w + 2*radius + 63) / 64;
+    tmp.assign(in, in + words);
+    // the padding bits of the last word are outside the image and must be neutral as well
+    if(w & 63) {
+        const uint64_t pad = ~(((uint64_t)1 << (w & 63)) - 1);
+        tmp[words-1] = (tmp[words-1] & ~pad) | (fill & pad);
+    }
+    p.resize(ext_words);
+    shift_row(tmp.data(), words, -radius, fill, p.data(), ext_words);
+    tmp.resize(ext_words);
+
+    int len = 1;
+    while(2*len <= window) {
+        shift_row(p.data(), ext_words, len, fill, tmp.data(), ext_words);
+        for(int i = 0; i < ext_words; ++i) p[i] = op(p[i], tmp[i]);
+        len *= 2;
+    }
+    shift_row(p.data(), ext_words, window - len, fill, tmp.data(), ext_words);
+    for(int i = 0; i < words; ++i) out[i] = op(p[i], tmp[i]);
+}
+
+template <typename Op>
+static void morph_mask(const binary_mask_t& in, int rx, int ry, uint64_t fill, Op op, binary_mask_t* out)
+{
+    const int words = in.words_per_row, h = in.h;
+    binary_mask_t tmp = make_binary_mask(in.w, in.h);
+    *out = make_binary_mask(in.w, in.h);
+
+    parallel_for(h, [&](int start, int end) {
+        std::vector<uint64_t> p, scratch;
+        for(int y = start; y < end; ++y) {
+            morph_mask_row(&in.bits[y*words], in.w, words, rx, fill, op, &tmp.bits[y*words], p, scratch);
+        }
+    }, 16);
+
+    parallel_for(words, [&](int start, int end) {
+        std::vector<uint64_t> g, hs;
+        van_herk_gil_werman(&tmp.bits[start], h, words, end - start, ry, fill, op, &out->bits[start], g, hs);
+    });
+    clear_mask_padding(out);
+}
+
+void erode_mask(const binary_mask_t& in, int rx, int ry, binary_mask_t* out)
+{
+    morph_mask(in, rx, ry, ~(uint64_t)0, [](uint64_t a, uint64_t b) { return a & b; }, out);
+}
+
+void dilate_mask(const binary_mask_t& in, int rx, int ry, binary_mask_t* out)
+{
+    morph_mask(in, rx, ry, (uint64_t)0, [](uint64_t a, uint64_t b) { return a | b; }, out);
+}
+
+void morphology_mask(const binary_mask_t& in, morph_op_t op, int rx, int ry, binary_mask_t* out)
+{
+    binary_mask_t tmp;
+    switch(op) {
+        case MORPH_ERODE:
+            erode_mask(in, rx, ry, out);
+            break;
+        case MORPH_DILATE:
+            dilate_mask(in, rx, ry, out);
+            break;
+        case MORPH_OPEN:
+            erode_mask(in, rx, ry, &tmp);
+            dilate_mask(tmp, rx, ry, out);
+            break;
+        case MORPH_CLOSE:
+            dilate_mask(in, rx, ry, &tmp);
+            erode_mask(tmp, rx, ry, out);
+            break;
+    }
+}
@@ -0,0 +1,129 @@
+#include "resample.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// output i reads taps contiguous input samples starting at start[i] with weights[i*taps + k]
+typedef struct {
+    int taps;
+    std::vector<int> start;
+    std::vector<float> weights;
+} resample_table_t;
+
+resample_filter_t get_resample_filter(const char* s)
+{
+    if(strcmp(s, "bilinear") == 0) return RESAMPLE_BILINEAR;
+    if(strcmp(s, "bicubic") == 0) return RESAMPLE_BICUBIC;
+    if(strcmp(s, "lanczos") == 0) return RESAMPLE_LANCZOS3;
+    return RESAMPLE_BICUBIC;
+}
+
+static float filter_support(resample_filter_t filter)
+{
+    switch(filter) {
+        case RESAMPLE_BILINEAR: return 1.f;
+        case RESAMPLE_BICUBIC: return 2.f;
+        case RESAMPLE_LANCZOS3: return 3.f;
+    }
+    return 1.f;
+}
+
+static float sinc(float x)
+{
+    if(fabsf(x) < 1e-6f) return 1.f;
+    x *= (float)M_PI;
+    return sinf(x) / x;
+}
+
+static float filter_weight(resample_filter_t filter, float x)
+{
+    x = fabsf(x);
+    switch(filter) {
+        case RESAMPLE_BILINEAR:
+            return x < 1.f ? 1.f - x : 0.f;
+        case RESAMPLE_BICUBIC: {
+            const float a = -0.5f;
+            if(x < 1.f) return ((a + 2.f)*x - (a + 3.f))*x*x + 1.f;
+            if(x < 2.f) return ((a*x - 5.f*a)*x + 8.f*a)*x - 4.f*a;
+            return 0.f;
+        }
+        case RESAMPLE_LANCZOS3:
+            return x < 3.f ? sinc(x) * sinc(x / 3.f) : 0.f;
+    }
+    return 0.f;
+}
+
+static resample_table_t make_resample_table(int in_size, int out_size, resample_filter_t filter)
+{
+    const float scale = (float)out_size / in_size;
+    // stretch the filter when shrinking so it also acts as the anti-aliasing filter
+    const float stretch = scale < 1.f ? 1.f / scale : 1.f;
+    const float radius = filter_support(filter) * stretch;
+
+    resample_table_t table;
+    table.taps = std::min(in_size, (int)ceilf(2*radius) + 1);
+    table.start.resize(out_size);
+    table.weights.assign(out_size*table.taps, 0.f);
+
+    for(int i = 0; i < out_size; ++i) {
+        const float center = (i + 0.5f) / scale - 0.5f;
+        const int lo = (int)ceilf(center - radius), hi = (int)floorf(center + radius);
+        const int start = std::min(std::max(lo, 0), in_size - table.taps);
+        float* weights = &table.weights[i*table.taps];
+
+        float sum = 0.f;
+        for(int k = lo; k <= hi; ++k) {
+            // taps outside the image land on the edge pixel, which keeps the window contiguous
+            const int j = std::min(std::max(k, 0), in_size-1);
+            const float weight = filter_weight(filter, (k - center) / stretch);
+            weights[j - start] += weight;
+            sum += weight;
+        }
+        if(sum != 0.f) for(int k = 0; k < table.taps; ++k) weights[k] /= sum;
+        table.start[i] = start;
+    }
+    return table;
+}
+
+void resize_image(const image_t& in, int w, int h, image_t* out, resample_filter_t filter)
+{
+    assert(w > 0 && h > 0);
+    const resample_table_t tx = make_resample_table(in.w, w, filter);
+    const resample_table_t ty = make_resample_table(in.h, h, filter);
+    image_t tmp = make_image(w, in.h, in.c);
+    *out = make_image(w, h, in.c);
+
+    // horizontal pass: every output pixel is a dot product over contiguous input samples
+    parallel_for(in.h*in.c, [&](int start, int end) {
+        for(int row = start; row < end; ++row) {
+            const float* src = &in.data[row*in.w];
+            float* dst = &tmp.data[row*w];
+            for(int x = 0; x < w; ++x) {
+                const float* s = src + tx.start[x];
+                const float* weights = &tx.weights[x*tx.taps];
+                float val = 0.f;
+                for(int k = 0; k < tx.taps; ++k) val += weights[k]*s[k];
+                dst[x] = val;
+            }
+        }
+    }, 8);
+
+    // vertical pass: whole rows are scaled and accumulated, so the inner loop vectorizes over x
+    parallel_for(h*in.c, [&](int start, int end) {
+        for(int row = start; row < end; ++row) {
+            const int c = row / h, y = row % h;
+            float* dst = &out->data[row*w];
+            const float* weights = &ty.weights[y*ty.taps];
+            for(int k = 0; k < ty.taps; ++k) {
+                const float* src = &tmp.data[(c*in.h + ty.start[y] + k)*w];
+                const float weight = weights[k];
+                if(weight == 0.f) continue;
+                for(int x = 0; x < w; ++x) dst[x] += weight*src[x];
+            }
+        }
+    }, 8);
+}
@@ -0,0 +1,141 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static thread_local bool inside_parallel_for = false;
+
+class thread_pool_t {
+public:
+    thread_pool_t() : stop(false)
+    {
+        start(std::max(1, (int)std::thread::hardware_concurrency()));
+    }
+
+    ~thread_pool_t()
+    {
+        join();
+    }
+
+    void resize(int num_threads)
+    {
+        join();
+        start(std::max(1, num_threads));
+    }
+
+    int size() const { return num_threads; }
+
+    void push(const std::function<void()>& task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(task);
+        }
+        task_ready.notify_one();
+    }
+
+private:
+    // the calling thread takes part in every parallel_for, so the pool only owns num_threads-1 workers
+    void start(int n)
+    {
+        num_threads = n;
+        stop = false;
+        for(int i = 0; i < num_threads-1; ++i) workers.push_back(std::thread(&thread_pool_t::run, this));
+    }
+
+    void join()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        task_ready.notify_all();
+        for(auto& worker : workers) worker.join();
+        workers.clear();
+    }
+
+    void run()
+    {
+        for(;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                task_ready.wait(lock, [this]{ return stop || !tasks.empty(); });
+                if(tasks.empty()) return;
+                task = tasks.front();
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    int num_threads;
+    bool stop;
+    std::deque<std::function<void()> > tasks;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable task_ready;
+};
+
+static thread_pool_t& get_thread_pool()
+{
+    static thread_pool_t pool;
+    return pool;
+}
+
+int get_num_threads()
+{
+    return get_thread_pool().size();
+}
+
+void set_num_threads(int num_threads)
+{
+    get_thread_pool().resize(num_threads);
+}
+
+void parallel_for(int n, const std::function<void(int,int)>& fn, int min_chunk)
+{
+    if(n <= 0) return;
+    thread_pool_t& pool = get_thread_pool();
+
+    // a few chunks per thread so uneven chunks balance out
+    int max_chunks = (n + std::max(1, min_chunk) - 1) / std::max(1, min_chunk);
+    int num_chunks = std::min(4*pool.size(), max_chunks);
+    if(num_chunks <= 1 || pool.size() == 1 || inside_parallel_for) {
+        fn(0, n);
+        return;
+    }
+
+    std::atomic<int> next_chunk(0);
+    auto run_chunks = [&]() {
+        bool was_inside = inside_parallel_for;
+        inside_parallel_for = true;
+        for(int i; (i = next_chunk++) < num_chunks; ) {
+            int start = (long long)n*i/num_chunks, end = (long long)n*(i+1)/num_chunks;
+            fn(start, end);
+        }
+        inside_parallel_for = was_inside;
+    };
+
+    int num_helpers = std::min(pool.size(), num_chunks) - 1;
+    int num_done = 0;
+    std::mutex done_mutex;
+    std::condition_variable done;
+    for(int i = 0; i < num_helpers; ++i) {
+        pool.push([&]() {
+            run_chunks();
+            std::lock_guard<std::mutex> lock(done_mutex);
+            if(++num_done == num_helpers) done.notify_one();
+        });
+    }
+    run_chunks();
+
+    // helpers reference this stack frame, so wait for all of them even if the work is already done
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done.wait(lock, [&]{ return num_done == num_helpers; });
+}